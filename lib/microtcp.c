@@ -18,19 +18,668 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include "microtcp.h"
+#include "microtcp_cc.h"
+#include "microtcp_demux.h"
 #include "../utils/crc32.h"
+#include <poll.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <linux/filter.h>
+
+/*
+ * CRC-32 of a segment over the header (with a zeroed checksum field) and then
+ * the payload, the order the original microTCP puts on the wire. The sender
+ * keeps the CRC of every in-flight payload on its own, checksum_payload(), and
+ * checksum_finish() joins it to the header of each transmission the way
+ * zlib's crc32_combine() does, so a resent payload is never read again:
+ * appending len bytes to a message multiplies its CRC by x^(8 len) modulo the
+ * polynomial.
+ */
+#define CRC32_POLY 0xedb88320           //the polynomial, bit reflected like the CRC
+
+//a * b modulo the polynomial, a must not be 0
+static uint32_t
+crc32_multmodp(uint32_t a, uint32_t b)
+{
+    uint32_t m = (uint32_t) 1 << 31;
+    uint32_t p = 0;
+
+    for(;;){
+        if(a & m){
+            p ^= b;
+            if((a & (m - 1)) == 0) break;
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ CRC32_POLY : b >> 1;
+    }
+
+    return p;
+}
+
+//x^(8 len) modulo the polynomial, by repeated squaring
+static uint32_t
+crc32_x8nmodp(size_t len)
+{
+    uint32_t p = (uint32_t) 1 << 31;    //x^0
+    uint32_t x2k = (uint32_t) 1 << 23;  //x^8
+
+    while(len > 0){
+        if(len & 1) p = crc32_multmodp(x2k, p);
+        x2k = crc32_multmodp(x2k, x2k);
+        len >>= 1;
+    }
+
+    return p;
+}
+
+//running CRC after the header, the payload goes on from it
+static uint32_t
+checksum_header(const microtcp_header_t *header)
+{
+    microtcp_header_t zeroed = *header;
+
+    zeroed.checksum = 0;
+    return update_crc32(0xffffffff, (const uint8_t *) &zeroed, sizeof(zeroed));
+}
+
+//CRC-32 of a payload by itself
+static uint32_t
+checksum_payload(const uint8_t *payload, size_t len)
+{
+    return update_crc32(0xffffffff, payload, len) ^ 0xffffffff;
+}
+
+//checksum of a segment whose len bytes of payload have the CRC payload_crc
+static uint32_t
+checksum_finish(uint32_t payload_crc, size_t len, const microtcp_header_t *header)
+{
+    return crc32_multmodp(crc32_x8nmodp(len), checksum_header(header) ^ 0xffffffff) ^ payload_crc;
+}
+
+static uint32_t
+segment_checksum(const microtcp_header_t *header, const uint8_t *payload, size_t len)
+{
+    return update_crc32(checksum_header(header), payload, len) ^ 0xffffffff;
+}
+
+//checksum of a control segment without a payload, only its header counts.
+//The message_t it is built in never has its payload read
+static uint32_t
+header_checksum(const microtcp_header_t *header)
+{
+    return segment_checksum(header, NULL, 0);
+}
+
+//monotonic time in microseconds, used to time the in-flight segments
+static uint64_t
+now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+//turns a 32-bit seq#/ack# from the wire back into our full width counter,
+//picking the value closest to ref
+static size_t
+seq_expand(size_t ref, uint32_t wire)
+{
+    return ref + (int32_t) (wire - (uint32_t) ref);
+}
+
+/*
+ * Feeds one RTT measurement to the Jacobson/Karels estimator (RFC 6298) and
+ * recomputes the RTO, which also cancels any backoff. Callers only pass
+ * samples of segments that were never retransmitted (Karn's rule).
+ */
+static void
+rtt_sample(microtcp_sock_t *socket, uint64_t rtt_us)
+{
+    uint64_t delta;
+
+    if(socket->srtt_us == 0){
+        socket->srtt_us = rtt_us;
+        socket->rttvar_us = rtt_us / 2;
+    }else{
+        delta = socket->srtt_us > rtt_us ? socket->srtt_us - rtt_us : rtt_us - socket->srtt_us;
+        //rttvar = 3/4 rttvar + 1/4 |srtt - rtt|, srtt = 7/8 srtt + 1/8 rtt
+        socket->rttvar_us = (3 * socket->rttvar_us + delta) / 4;
+        socket->srtt_us = (7 * socket->srtt_us + rtt_us) / 8;
+    }
+
+    socket->rto_us = socket->srtt_us + 4 * socket->rttvar_us;
+    if(socket->rto_us < MICROTCP_MIN_RTO_US) socket->rto_us = MICROTCP_MIN_RTO_US;
+    if(socket->rto_us > MICROTCP_MAX_RTO_US) socket->rto_us = MICROTCP_MAX_RTO_US;
+}
+
+//doubles the RTO after a timeout, up to MICROTCP_MAX_RTO_US
+static void
+rto_backoff(microtcp_sock_t *socket)
+{
+    socket->rto_us *= 2;
+    if(socket->rto_us > MICROTCP_MAX_RTO_US) socket->rto_us = MICROTCP_MAX_RTO_US;
+}
+
+//32-bit clock the TSval of every segment is taken from, in microseconds
+static uint32_t
+ts_now(void)
+{
+    return (uint32_t) now_us();
+}
+
+//stamps TSval and the TSecr echo on an outgoing header if timestamps are on
+static void
+stamp_header(microtcp_sock_t *socket, microtcp_header_t *header)
+{
+    header->future_use0 = socket->ts_ok ? ts_now() : 0;
+    header->future_use1 = socket->ts_ok ? socket->ts_recent : 0;
+}
+
+//smallest shift that lets the window field cover a buffer of len bytes
+static int
+wscale_for(size_t len)
+{
+    int shift = 0;
+
+    while(shift < MICROTCP_MAX_WSCALE && (len >> shift) > UINT16_MAX) shift++;
+    return shift;
+}
+
+//the window field of an outgoing segment, the window in units of our scale
+static uint16_t
+window_field(const microtcp_sock_t *socket)
+{
+    return min(socket->curr_win_size >> socket->rcv_wscale, UINT16_MAX, SIZE_MAX);
+}
+
+/*
+ * Largest segment the route to address takes without IP fragmentation, from
+ * the MTU of the interface the kernel would send through: 65507 bytes on
+ * loopback, about 9 KB on a jumbo frame link. MICROTCP_MSS if the kernel
+ * cannot tell.
+ */
+static size_t
+route_mss(const struct sockaddr *address, socklen_t address_len)
+{
+    int probe;
+    int mtu;
+    socklen_t len = sizeof(mtu);
+    size_t overhead;
+    int ret;
+
+    //only a connected UDP socket knows its route
+    probe = socket(address->sa_family, SOCK_DGRAM, 0);
+    if(probe == -1) return MICROTCP_MSS;
+    if(address->sa_family == AF_INET6){
+        overhead = 40 + 8;
+        ret = connect(probe, address, address_len) == -1 ? -1 : getsockopt(probe, IPPROTO_IPV6, IPV6_MTU, &mtu, &len);
+    }else{
+        overhead = 20 + 8;
+        ret = connect(probe, address, address_len) == -1 ? -1 : getsockopt(probe, IPPROTO_IP, IP_MTU, &mtu, &len);
+    }
+    close(probe);
+    if(ret == -1 || mtu <= (int) overhead) return MICROTCP_MSS;
+
+    if((size_t) mtu - overhead < MICROTCP_MIN_MSS) return MICROTCP_MIN_MSS;
+    if((size_t) mtu - overhead > MICROTCP_MAX_MSS) return MICROTCP_MAX_MSS;
+    return mtu - overhead;
+}
+
+/*
+ * Path MTU discovery in the packetization layer (RFC 8899). The MSS agreed
+ * at the handshake only says what both ends take, a router in between may
+ * take less and with DF set it drops what does not fit. So the sender
+ * starts from MICROTCP_MSS and searches up to the agreed size with probes:
+ * PROBE_FLAG segments of the size under test whose payload is padding. They
+ * take no sequence space and no window, losing one costs nothing but the
+ * probe. The receiver answers a probe with a PROBE_FLAG ACK naming its
+ * size, which makes that the MSS. MICROTCP_PROBE_TRIES lost probes of one
+ * size move the top of the search below it. A finished search starts over
+ * after MICROTCP_PROBE_RAISE_US in case the path got bigger, and a path
+ * that got smaller shows up as full size segments that keep getting lost,
+ * see pmtu_black_hole().
+ */
+static void
+pmtu_start(microtcp_sock_t *socket)
+{
+    socket->max_mss = socket->mss;
+    if(socket->mss > MICROTCP_MSS) socket->mss = MICROTCP_MSS;
+    socket->probe_high = socket->max_mss;
+    socket->probe_size = 0;
+    socket->probe_tries = 0;
+    socket->probe_us = 0;
+}
+
+//sends the next probe of the search, if there is data to make it worth it
+static int
+pmtu_probe(microtcp_sock_t *socket, uint64_t now)
+{
+    microtcp_header_t header;
+    struct iovec iov[2];
+    struct msghdr msg;
+    size_t size;
+
+    if(socket->probe_size != 0 || now < socket->probe_us) return 0;
+    if(socket->sndbuf_nxt == socket->sndbuf_end && socket->inflight_count == 0) return 0;
+    if(socket->probe_high < socket->mss + MICROTCP_PROBE_STEP){
+        socket->probe_high = socket->max_mss;
+        socket->probe_us = now + MICROTCP_PROBE_RAISE_US;
+        return 0;
+    }
+    size = (socket->mss + socket->probe_high + 1) / 2;
+
+    header.seq_number = socket->seq_number;
+    header.ack_number = socket->ack_number;
+    header.control = PROBE_FLAG;
+    header.window = window_field(socket);
+    header.data_len = size - sizeof(header);
+    stamp_header(socket, &header);
+    header.future_use2 = socket->conn_id;
+    //the padding is whatever the send buffer holds, it is for this peer anyway
+    header.checksum = segment_checksum(&header, socket->sndbuf, header.data_len);
+
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = socket->sndbuf;
+    iov[1].iov_len = header.data_len;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &socket->peerAdress;
+    msg.msg_namelen = socket->peerAdressLen;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    if(sendmsg(socket->sd, &msg, 0) == -1){
+        //bigger than our own interface takes, no need to wait for that
+        if(errno != EMSGSIZE) return -1;
+        socket->probe_high = size - 1;
+        return 0;
+    }
+#ifdef DEBUGPRINTS
+    printf("path MTU probe of %zu bytes (mss %zu)\n", size, socket->mss);
+#endif
+    socket->probe_size = size;
+    socket->probe_us = now;
+    socket->probe_heard = socket->packets_received;
+
+    return 0;
+}
+
+//a probe came back, its size goes through
+static void
+pmtu_probe_acked(microtcp_sock_t *socket, const message_t *message)
+{
+    uint32_t size;
+
+    if(message->header.data_len != sizeof(size)) return;
+    memcpy(&size, message->payload, sizeof(size));
+    if(size != socket->probe_size) return;
+
+    socket->mss = size;
+    socket->probe_size = 0;
+    socket->probe_tries = 0;
+    socket->probe_us = 0;
+}
+
+//gives up on a probe that has not come back in an RTO
+static void
+pmtu_probe_timer(microtcp_sock_t *socket, uint64_t now)
+{
+    if(socket->probe_size == 0 || now < socket->probe_us + socket->rto_us) return;
+
+    //a peer we have not heard from since says nothing about the path, it
+    //may just not be reading, so only then does the probe count as lost
+    if(socket->packets_received != socket->probe_heard && ++socket->probe_tries >= MICROTCP_PROBE_TRIES){
+        socket->probe_high = socket->probe_size - 1;
+        socket->probe_tries = 0;
+    }
+    socket->probe_size = 0;
+    socket->probe_us = now;
+}
+
+//size of one slot of segbuf, never shorter than a message_t as the control
+//segments are read into it too, and rounded up to keep every header aligned.
+//A socket of a listening socket may read the segments of any of its
+//connections, whatever MSS they agreed on
+static size_t
+segbuf_len(const microtcp_sock_t *socket)
+{
+    size_t mss = socket->demux != NULL ? MICROTCP_MAX_MSS : socket->max_mss;
+    size_t len = mss > sizeof(message_t) ? mss : sizeof(message_t);
+
+    return (len + 7) & ~(size_t) 7;
+}
+
+/*
+ * (Re)sizes the receive batch for the largest MSS of the socket: as many
+ * slots of a whole segment as fit in MICROTCP_RECV_BATCH_BYTES, or in the
+ * receive buffer if that is smaller, up to MICROTCP_RECV_BATCH. Anything
+ * read into it and not handed out yet is dropped.
+ *
+ * returns:
+ *      0 for success
+ *      -1 for failure
+ */
+static int
+segment_buffers(microtcp_sock_t *socket)
+{
+    uint8_t *segbuf;
+    size_t slots = min(MICROTCP_RECV_BATCH_BYTES, socket->recvbuf_len, SIZE_MAX) / segbuf_len(socket);
+
+    if(slots > MICROTCP_RECV_BATCH) slots = MICROTCP_RECV_BATCH;
+    if(slots == 0) slots = 1;
+
+    segbuf = realloc(socket->segbuf, slots * segbuf_len(socket));
+    if(segbuf == NULL) return -1;
+    socket->segbuf = segbuf;
+    socket->rx_slots = slots;
+    socket->rx_count = 0;
+    socket->rx_next = 0;
+
+    return 0;
+}
+
+//the receive ring starts at the first byte the peer will send, called once
+//the 3-way handshake has set the ack#
+static void
+recv_start(microtcp_sock_t *socket)
+{
+    socket->buf_read_pos = socket->ack_number;
+    socket->buf_fill_level = 0;
+    socket->ooo_high = socket->ack_number;
+    socket->ooo_last = socket->ack_number;
+    socket->rcv_seg = 0;
+    socket->curr_win_size = socket->recvbuf_len;
+}
+
+//writes the options we want into the payload of a SYN or SYN + ACK,
+//returns their length that goes in data_len
+static uint32_t
+put_syn_options(microtcp_sock_t *socket, uint8_t *payload)
+{
+    uint32_t len = 0;
+    uint16_t mss = socket->max_mss;
+
+    payload[len++] = MICROTCP_OPT_MSS;
+    payload[len++] = 4;
+    memcpy(payload + len, &mss, sizeof(mss));
+    len += sizeof(mss);
+    if(socket->ts_ok){
+        payload[len++] = MICROTCP_OPT_TIMESTAMP;
+        payload[len++] = 2;
+    }
+    if(socket->sack_blocks > 0){
+        payload[len++] = MICROTCP_OPT_SACK;
+        payload[len++] = 3;
+        payload[len++] = socket->sack_blocks;
+    }
+    if(socket->rcv_wscale > 0){
+        payload[len++] = MICROTCP_OPT_WSCALE;
+        payload[len++] = 3;
+        payload[len++] = socket->rcv_wscale;
+    }
+    payload[len++] = MICROTCP_OPT_END;
+
+    return len;
+}
+
+//reads the options the peer offered in its SYN or SYN + ACK, anything we do
+//not know is skipped
+static void
+parse_syn_options(microtcp_sock_t *socket, const message_t *message)
+{
+    uint32_t i = 0;
+    uint8_t kind;
+    uint8_t len;
+    uint16_t mss;
+    int wscale_ok = 0;
+    int mss_ok = 0;
+
+    socket->ts_ok = 0;
+    socket->sack_blocks = 0;
+    socket->snd_wscale = 0;
+    while(i < message->header.data_len){
+        kind = message->payload[i];
+        if(kind == MICROTCP_OPT_END) break;
+        if(i + 1 >= message->header.data_len) break;
+        len = message->payload[i + 1];
+        if(len < 2 || i + len > message->header.data_len) break;
+
+        if(kind == MICROTCP_OPT_TIMESTAMP){
+            socket->ts_ok = 1;
+            socket->ts_recent = message->header.future_use0;
+        }else if(kind == MICROTCP_OPT_SACK && len == 3){
+            socket->sack_blocks = message->payload[i + 2] < MICROTCP_SACK_BLOCKS ?
+                                  message->payload[i + 2] : MICROTCP_SACK_BLOCKS;
+        }else if(kind == MICROTCP_OPT_MSS && len == 4){
+            //the segments go both ways, both sides use the smaller one
+            mss_ok = 1;
+            memcpy(&mss, message->payload + i + 2, sizeof(mss));
+            if(mss < MICROTCP_MIN_MSS) mss = MICROTCP_MIN_MSS;
+            if(mss < socket->mss) socket->mss = mss;
+        }else if(kind == MICROTCP_OPT_WSCALE && len == 3){
+            wscale_ok = 1;
+            socket->snd_wscale = message->payload[i + 2] < MICROTCP_MAX_WSCALE ?
+                                 message->payload[i + 2] : MICROTCP_MAX_WSCALE;
+        }
+        i += len;
+    }
+
+    //scaling is used in both directions or in none, a peer that did not
+    //offer it reads our window field unscaled
+    if(!wscale_ok) socket->rcv_wscale = 0;
+    if(!mss_ok && socket->mss > MICROTCP_MSS) socket->mss = MICROTCP_MSS;
+}
+
+//waits up to wait_us (MICROTCP_WAIT_FOREVER for no limit) for a datagram to
+//read, returns -1 with errno EAGAIN if none came in time
+static int
+wait_readable(microtcp_sock_t *socket, uint64_t wait_us)
+{
+    struct pollfd pfd;
+    struct timespec timeout;
+    int ret;
+
+    pfd.fd = socket->sd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    timeout.tv_sec = wait_us / 1000000;
+    timeout.tv_nsec = (wait_us % 1000000) * 1000;
+
+    ret = ppoll(&pfd, 1, wait_us == MICROTCP_WAIT_FOREVER ? NULL : &timeout, NULL);
+    if(ret == 0){
+        errno = EAGAIN;
+        return -1;
+    }
+
+    return ret < 0 ? -1 : 0;
+}
+
+static int
+send_flush(microtcp_sock_t *socket);
+static int
+process_ack(microtcp_sock_t *socket, const message_t *message);
+static int
+check_retransmission_timer(microtcp_sock_t *socket);
+static int
+transmit_new(microtcp_sock_t *socket);
+static int
+ack_flush(microtcp_sock_t *socket);
+static int
+wait_close_segment(microtcp_sock_t *socket, message_t *message, uint16_t flags, const message_t *resend);
+static ssize_t
+recv_segment(microtcp_sock_t *socket, const message_t *message, ssize_t received,
+             uint8_t *buffer, size_t length);
+int
+sentACK(microtcp_sock_t *socket);
+static ssize_t
+next_datagram(microtcp_sock_t *socket, message_t **message, uint64_t wait_us);
+static void
+close_linger(microtcp_sock_t *socket, const message_t *ack);
+static uint64_t
+timer_wait(microtcp_sock_t *socket, uint64_t wait_us);
+static int
+run_timers(microtcp_sock_t *socket);
+static void
+sock_release(microtcp_sock_t *socket);
+static void
+conn_drop(microtcp_sock_t *conn);
+static void
+engine_enter(microtcp_sock_t *socket);
+static void
+engine_leave(microtcp_sock_t *socket);
+static void
+engine_stop(microtcp_sock_t *socket);
+
+//checks a segment read into segbuf, whose payload may run past a message_t's
+static int
+check_segment_checksum(const message_t *message)
+{
+    if(message->header.checksum != segment_checksum(&message->header, message->payload, message->header.data_len)){
+        return -1;
+    }
+
+    return 0;
+}
+
+//bytes of a segment on the wire, the header and only the payload data_len
+//counts, control segments go out as the header and their options
+static size_t
+message_len(const message_t *message)
+{
+    return sizeof(message->header) + message->header.data_len;
+}
+
+//checks a datagram of received bytes read into message: it must hold the
+//header and all the payload data_len says, and a good checksum
+static int
+check_received_segment(const message_t *message, ssize_t received)
+{
+    if(received < (ssize_t) sizeof(message->header)) return -1;
+    if(message->header.data_len > (size_t) received - sizeof(message->header)) return -1;
+
+    return check_segment_checksum(message);
+}
 
 int
 check_resived_checksum(message_t message){
-    uint32_t revivedChecksum = message.header.checksum;
+    if(message.header.data_len > sizeof(message.payload)){
+        return -1;
+    }
 
-    //zero out the cheksum in the message as that's how the sender calculated
-    message.header.checksum = 0;
-    if(revivedChecksum != crc32((const uint8_t*) &message, sizeof(message) + message.header.data_len)){
+    if(message.header.checksum != segment_checksum(&message.header, message.payload, message.header.data_len)){
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Allocates the receive buffers of a socket and sets up the rest of its
+ * state, all but the UDP socket. recvbuf_len is the size of its receive
+ * ring, the window it advertises, sndbuf_len the most its send buffer may
+ * take, that buffer comes with the first send. Shared by microtcp_socket()
+ * and the connections a listening socket creates.
+ *
+ * returns:
+ *      0 for success
+ *      -1 for failure, nothing is left allocated
+ */
+static int
+sock_init(microtcp_sock_t *sock, size_t recvbuf_len, size_t sndbuf_len)
+{
+    sock->init_win_size = recvbuf_len;
+    sock->curr_win_size = recvbuf_len;
+    sock->recvbuf_len = recvbuf_len;
+    sock->recvbuf = malloc(recvbuf_len);
+
+    //check malloc
+    if(sock->recvbuf == NULL){
+        return -1;
+    }
+    sock->buf_fill_level = 0;
+    sock->buf_read_pos = 0;
+
+    sock->inflight = NULL;
+    sock->inflight_len = 0;
+    sock->inflight_head = 0;
+    sock->inflight_count = 0;
+    sock->snd_una = 0;
+    sock->recover = 0;
+    sock->dup_acks = 0;
+    sock->rto_recovery = 0;
+    sock->peer_win_size = MICROTCP_WIN_SIZE;
+    sock->snd_wscale = 0;
+    sock->rcv_wscale = wscale_for(recvbuf_len);
+    sock->srtt_us = 0;
+    sock->rttvar_us = 0;
+    sock->rto_us = MICROTCP_ACK_TIMEOUT_US;
+    sock->rto_retries = 0;
+    sock->ts_ok = 1;
+    sock->ts_recent = 0;
+    sock->sack_blocks = MICROTCP_SACK_BLOCKS;
+    sock->recovery_us = 0;
+    sock->delivered = 0;
+    sock->delivered_us = 0;
+    sock->first_sent_us = 0;
+    sock->app_limited = 0;
+    sock->pacing_next_us = 0;
+    sock->persist_us = 0;
+
+    sock->sndbuf = NULL;
+    sock->rcv_map = calloc(recvbuf_len / 64, sizeof(uint64_t));
+    if(sock->rcv_map == NULL){
+        free(sock->recvbuf);
+        return -1;
+    }
+    sock->ooo_high = 0;
+    sock->ooo_last = 0;
+    sock->rcv_seg = 0;
+    sock->ack_pending = 0;
+    sock->ack_due_us = 0;
+
+    sock->demux = NULL;
+    sock->rxq = NULL;
+    sock->rxq_head = 0;
+    sock->rxq_tail = 0;
+    sock->syn_sent_us = 0;
+    sock->syn_retries = 0;
+    sock->conn_id = 0;
+    sock->engine = NULL;
+
+    sock->mss = MICROTCP_MSS;
+    sock->max_mss = MICROTCP_MSS;
+    sock->probe_size = 0;
+    sock->probe_high = MICROTCP_MSS;
+    sock->probe_tries = 0;
+    sock->probe_us = 0;
+    sock->probe_heard = 0;
+    sock->segbuf = NULL;
+    if(segment_buffers(sock) == -1){
+        free(sock->recvbuf);
+        free(sock->rcv_map);
+        free(sock->segbuf);
         return -1;
     }
 
+    sock->sndbuf_len = sndbuf_len;
+    sock->sndbuf_una = 0;
+    sock->sndbuf_nxt = 0;
+    sock->sndbuf_end = 0;
+    microtcp_set_congestion_control(sock, MICROTCP_CC_DEFAULT);
+    sock->seq_number = 0;
+    sock->ack_number = 0;
+    sock->packets_send = 0;
+    sock->packets_received = 0;
+    sock->packets_lost = 0;
+    sock->bytes_send = 0;
+    sock->bytes_received = 0;
+    sock->bytes_lost = 0;
+    sock->isServer = 0;
+
     return 0;
 }
 
@@ -47,34 +696,59 @@ microtcp_socket (int domain, int type, int protocol)
     if(sock.sd == -1){
         return sock;
     }
+    //room for a few windows of large segments, the kernel caps it at
+    //net.core.rmem_max and wmem_max
+    setsockopt(sock.sd, SOL_SOCKET, SO_RCVBUF, &(int) {MICROTCP_RECVBUF_LEN}, sizeof(int));
+    setsockopt(sock.sd, SOL_SOCKET, SO_SNDBUF, &(int) {MICROTCP_SNDBUF_LEN}, sizeof(int));
+    //DF on every datagram, too big is dropped rather than fragmented, and
+    //the size is ours to find out, see pmtu_probe()
+    if(domain == AF_INET6){
+        setsockopt(sock.sd, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &(int) {IPV6_PMTUDISC_PROBE}, sizeof(int));
+    }else{
+        setsockopt(sock.sd, IPPROTO_IP, IP_MTU_DISCOVER, &(int) {IP_PMTUDISC_PROBE}, sizeof(int));
+    }
 
     /*Initializing everything else*/
-    sock.init_win_size = MICROTCP_WIN_SIZE;
-    sock.curr_win_size = MICROTCP_WIN_SIZE;
-    sock.recvbuf = malloc(MICROTCP_RECVBUF_LEN);
-
-    //check malloc
-    if(sock.recvbuf == NULL){
+    if(sock_init(&sock, MICROTCP_RECVBUF_LEN, MICROTCP_SNDBUF_LEN) == -1){
+        close(sock.sd);
         sock.sd = -2;
         return sock;
     }
-    sock.buf_fill_level = 0;
-    sock.cwnd = MICROTCP_INIT_CWND;
-    sock.ssthresh = MICROTCP_INIT_SSTHRESH;
-    sock.seq_number = 0;
-    sock.ack_number = 0;
-    sock.packets_send = 0;
-    sock.packets_received = 0;
-    sock.packets_lost = 0;
-    sock.bytes_send = 0;
-    sock.bytes_received = 0;
-    sock.bytes_lost = 0;
-    sock.isServer = 0;
 
     sock.state = CLOSED;
     return  sock;
 }
 
+//frees what a closed socket holds. A socket of a demux leaves it, the last
+//one to go closes the UDP socket they shared
+static void
+sock_release(microtcp_sock_t *socket)
+{
+    microtcp_demux_t *demux = socket->demux;
+
+    free(socket->recvbuf);
+    free(socket->inflight);
+    free(socket->sndbuf);
+    free(socket->rcv_map);
+    free(socket->segbuf);
+    free(socket->rxq);
+    socket->rxq = NULL;
+
+    if(demux == NULL) return;
+    if(socket->state != LISTEN){
+        //the key without an id may be a later connection of the same peer's
+        if(microtcp_demux_lookup(demux, &socket->peerAdress, 0) == socket){
+            microtcp_demux_remove(demux, &socket->peerAdress, 0);
+        }
+        microtcp_demux_remove(demux, &socket->peerAdress, socket->conn_id);
+    }
+    socket->demux = NULL;
+    if(--demux->users == 0){
+        close(socket->sd);
+        microtcp_demux_free(demux);
+    }
+}
+
 
 
 int
@@ -101,6 +775,9 @@ microtcp_connect (microtcp_sock_t *socket, const struct sockaddr *address,
     if (socket->state == INVALID) return -1;
 
     uint32_t  my_seq_num;
+    uint64_t syn_sent_us;
+    ssize_t received;
+    int retries = 0;
 
     //we start the 3-way handshake
 #ifdef DEBUGPRINTS
@@ -117,26 +794,29 @@ microtcp_connect (microtcp_sock_t *socket, const struct sockaddr *address,
     header.seq_number = socket->seq_number;
     header.ack_number = 0;
     header.control = SYN_FLAG;
-    header.window = socket->curr_win_size;
+    //the window of a SYN is never scaled
+    header.window = min(socket->curr_win_size, UINT16_MAX, SIZE_MAX);
     header.data_len = 0;
-    header.future_use0 = 0;
+    header.future_use0 = ts_now();
     header.future_use1 = 0;
-    header.future_use2 = 0;
+    header.future_use2 = socket->conn_id;
     header.checksum = 0;
     //memset(&header.checksum, 0, sizeof(header.checksum));
 
-    //malloc space for resFuff
-    socket->recvbuf = malloc(socket->curr_win_size);
+    //offer the largest segment our route takes
+    socket->max_mss = socket->mss = route_mss(address, address_len);
 
     //creating the buf of the containing the message
     message_t message;
     message.header = header;
-    //message.payload = NULL;
+    //the payload of the SYN carries the options we offer
+    message.header.data_len = put_syn_options(socket, message.payload);
 
-    message.header.checksum = crc32((const uint8_t*) &message, sizeof(message));
+    message.header.checksum = segment_checksum(&message.header, message.payload, message.header.data_len);
 
     //sent the initial request for connection to the server (SYN)
-    if(sendto(socket->sd, &message, sizeof(message), 0, address, address_len) == -1){
+    syn_sent_us = now_us();
+    if(sendto(socket->sd, &message, message_len(&message), 0, address, address_len) == -1){
         return -1;
     }
     socket->seq_number++;
@@ -145,19 +825,35 @@ microtcp_connect (microtcp_sock_t *socket, const struct sockaddr *address,
 #endif
 
 
-    void *resbuff[MICROTCP_WIN_SIZE];
+    //the SYN goes out again every RTO, backed off, until the server answers
+    while(wait_readable(socket, socket->rto_us) == -1){
+        if(errno == EINTR) continue;
+        if(errno != EAGAIN) return -1;
+        if(++retries > MICROTCP_SYN_RETRIES){
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        rto_backoff(socket);
+        if(sendto(socket->sd, &message, message_len(&message), 0, address, address_len) == -1){
+            return -1;
+        }
+#ifdef DEBUGPRINTS
+        printf("no SYN + ACK, sent SYN again\n\n");
+#endif
+    }
+
     //we reseving the message initial message for the request to connect (from the client)
-    if( recvfrom(socket->sd, &resbuff, socket->init_win_size, 0, address, &address_len) == -1){
+    received = recvfrom(socket->sd, &message, sizeof(message), 0, address, &address_len);
+    if(received == -1){
         return -1;
     }
 
-    memcpy(&message, resbuff, sizeof(message_t));
 #ifdef DEBUGPRINTS
     printf("resived SYN + ACK with seq# = %d and ack# = %d\n\n", message.header.seq_number, message.header.ack_number);
 #endif
 
     //check that we revived the message correctly
-    if(check_resived_checksum(message))return -1;                                  //!!!!maybe state = invalide after exery return -1;
+    if(check_received_segment(&message, received))return -1;                      //!!!!maybe state = invalide after exery return -1;
 
     //check the controll flags
     if( ((message.header.control & (SYN_FLAG | ACK_FLAG)) != (SYN_FLAG | ACK_FLAG)) ) return -1;
@@ -165,27 +861,47 @@ microtcp_connect (microtcp_sock_t *socket, const struct sockaddr *address,
     //check the ACK
     if(message.header.ack_number != socket->seq_number) return -1;
 
+    //the SYN round trip is the first RTT sample, unless it was resent
+    if(retries == 0) rtt_sample(socket, now_us() - syn_sent_us);
+
+    //keep only the options the server agreed to
+    parse_syn_options(socket, &message);
+
+    //the segment buffers and the initial window follow the agreed MSS
+    pmtu_start(socket);
+    if(segment_buffers(socket) == -1) return -1;
+    if(microtcp_set_congestion_control(socket, socket->cc->name) == -1) return -1;
+
     //save the address of the peer we are gona try to handshake will
     memcpy(&(socket->peerAdress), address, sizeof(struct sockaddr));
     socket->peerAdressLen = address_len;
 
     //save the seq# we got from the client
     socket->ack_number = message.header.seq_number + 1;
+    recv_start(socket);
+
+    //every segment from now on carries the id the server gave us, 0 from a
+    //server without ids
+    socket->conn_id = message.header.future_use2;
 
     //now we sent the final piece of 3 way handsake with a ACK
     message.header.control = ACK_FLAG;
     message.header.seq_number = socket->seq_number;
     message.header.ack_number = socket->ack_number;
+    message.header.data_len = 0;
+    stamp_header(socket, &message.header);
+    message.header.future_use2 = socket->conn_id;
 
-    //get sented win soze
-    socket->curr_win_size = message.header.window;
+    //get sented win soze, unscaled like every SYN
+    socket->peer_win_size = message.header.window;
+    message.header.window = window_field(socket);
 
     //we zero the ckecksum and calsulate the knew one
     message.header.checksum = 0;
-    message.header.checksum = crc32((const uint8_t*) &message, sizeof(message));
+    message.header.checksum = header_checksum(&message.header);
 
     //sent the ack back to the server
-    if( sendto(socket->sd, &message, sizeof(message), 0, address, address_len) == -1){
+    if( sendto(socket->sd, &message, message_len(&message), 0, address, address_len) == -1){
         return -1;
     }
     socket->seq_number++;
@@ -194,130 +910,384 @@ microtcp_connect (microtcp_sock_t *socket, const struct sockaddr *address,
     printf("END 3-way handshke:\n");
 #endif
 
+    //nothing of ours is in flight yet, the first data byte is the oldest unacknowledged
+    socket->snd_una = socket->seq_number;
     socket->state = ESTABLISHED;
 
     return 0;
 }
 
-int
-microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address,
-                 socklen_t address_len)
+//sends the SYN + ACK that answers the SYN of the client, again if it asks
+//again, its seq# is the one before seq_number
+static int
+send_syn_ack(microtcp_sock_t *socket)
 {
     message_t message;
-#ifdef DEBUGPRINTS
-    printf("3-way handshke:\n\n");
-#endif
-    void *resbuff[MICROTCP_RECVBUF_LEN];
-    //we reseving the message initial message for the request to connect (SYN from the client)
 
-   if( recvfrom(socket->sd, &resbuff, socket->init_win_size, 0, address, &address_len) == -1){
+    message.header.seq_number = socket->seq_number - 1;
+    message.header.ack_number = socket->ack_number;
+    message.header.control = SYN_FLAG | ACK_FLAG;
+    //give the window size, unscaled in the SYN + ACK too
+    message.header.window = min(socket->curr_win_size, UINT16_MAX, SIZE_MAX);
+    message.header.data_len = put_syn_options(socket, message.payload);
+    stamp_header(socket, &message.header);
+    message.header.future_use2 = socket->conn_id;
+
+    //we zero the ckecksum and calsulate the knew one
+    message.header.checksum = 0;
+    message.header.checksum = segment_checksum(&message.header, message.payload, message.header.data_len);
+
+    //sent the ack for the sonnection back to the client
+    socket->syn_sent_us = now_us();
+    if(sendto(socket->sd, &message, message_len(&message), 0, &(socket->peerAdress), socket->peerAdressLen) == -1){
         return -1;
     }
-
-    memcpy(&message, resbuff, sizeof(message_t));
 #ifdef DEBUGPRINTS
-    printf("resived SYN with seq# = %d\n", message.header.seq_number);
+    printf("sent SYN + ACK with seq# = %d and ack# = %d\n\n", message.header.seq_number, message.header.ack_number);
 #endif
 
-    //check that we revived the message correctly
-    if(check_resived_checksum(message))return -1;
-
-    //check if we revived a header with only a ack in the control
-    if ((message.header.control & SYN_FLAG) != SYN_FLAG)return -1;
+    return 0;
+}
 
-    //save the address of the peer we are gona try to handshake will
-    memcpy(&(socket->peerAdress), address, sizeof(struct sockaddr));
-    socket->peerAdressLen = address_len;
+//takes in the SYN of the client whose address is in peerAdress and answers
+//it with a SYN + ACK
+static int
+syn_received(microtcp_sock_t *socket, const message_t *message)
+{
+    //save the window of the client, a SYN is never scaled
+    socket->peer_win_size = message->header.window;
 
-    //save the nagosiated winsize
-    socket->init_win_size = message.header.window;
-    socket->recvbuf = malloc(socket->init_win_size);
+    //agree to the options the client offered that we support, the MSS is
+    //the smaller of its offer and what our route takes
+    socket->mss = route_mss(&socket->peerAdress, socket->peerAdressLen);
+    parse_syn_options(socket, message);
+    pmtu_start(socket);
+    if(segment_buffers(socket) == -1) return -1;
+    if(microtcp_set_congestion_control(socket, socket->cc->name) == -1) return -1;
 
-    //now we sent the SYN + ACK to accept the connection
-    message.header.control = SYN_FLAG | ACK_FLAG;
-    srand((unsigned int)time(NULL) ^ (unsigned int)getpid());
     socket->seq_number = ((uint32_t) rand()) % 10000;
 #ifdef DEBUGPRINTS
     printf("\nSERVER generated seq# = %ld\n\n", socket->seq_number);
 #endif
-    socket->ack_number = message.header.seq_number + 1;
-    message.header.seq_number = socket->seq_number;
-    message.header.ack_number = socket->ack_number;
-    //give the window size
-    message.header.window = MICROTCP_RECVBUF_LEN;
+    //the SYN + ACK takes a seq#
+    socket->seq_number++;
+    socket->ack_number = message->header.seq_number + 1;
 
+    return send_syn_ack(socket);
+}
 
-    //we zero the ckecksum and calsulate the knew one
-    message.header.checksum = 0;
-    message.header.checksum = crc32((const uint8_t*) &message, sizeof(message));
+/*
+ * Takes the segment that completes a handshake we answered with a SYN + ACK:
+ * the ACK of the client, or its first data segment if that ACK got lost.
+ *
+ * returns:
+ *      0 for success, the connection is established
+ *      -1 if the segment does not complete it
+ */
+static int
+accept_complete(microtcp_sock_t *socket, const message_t *message)
+{
+    size_t seq = seq_expand(socket->ack_number, message->header.seq_number);
 
-    //sent the ack for the sonnection back to the client
-    if( sendto(socket->sd, &message, sizeof(message), 0, address, address_len) == -1){
-        return -1;
-    }
-    socket->seq_number++;
-#ifdef DEBUGPRINTS
-    printf("sent SYN + ACK with seq# = %d and ack# = %d\n\n", message.header.seq_number, message.header.ack_number);
-#endif
+    //check the ACK
+    if(message->header.ack_number != (uint32_t) socket->seq_number) return -1;
 
-    //we resive a ack as the final step of the 3-way handshake
-    if( recvfrom(socket->sd, &resbuff, socket->curr_win_size, 0, address, &address_len) == -1){
+    //the ACK takes a seq# of its own, the first data comes right after it.
+    //A client that answers a resent SYN + ACK is past its ACK already
+    if(message->header.control & ACK_FLAG){
+        if(message->header.control != ACK_FLAG || (seq != socket->ack_number && seq != socket->ack_number + 1)) return -1;
+    }else if(message->header.control != 0 || seq != socket->ack_number + 1){
         return -1;
     }
-    memcpy(&message, resbuff, sizeof(message_t));
-
-
-    //check that we revived the message correctly
-    if(check_resived_checksum(message))return -1;
-
-    //check if we revived a header with only a ack in the control
-    if ((message.header.control & ACK_FLAG) != ACK_FLAG)return -1;
 
-    //check the ACK
-    if(message.header.ack_number != socket->seq_number) return -1;
+    //the SYN + ACK round trip is the first RTT sample, unless it was resent
+    if(socket->syn_retries == 0) rtt_sample(socket, now_us() - socket->syn_sent_us);
+    socket->peer_win_size = (size_t) message->header.window << socket->snd_wscale;
+    if(socket->ts_ok) socket->ts_recent = message->header.future_use0;
 
     //save the seq# we got from the client
-    socket->ack_number = message.header.seq_number + 1;
+    socket->ack_number++;
+    recv_start(socket);
 
 #ifdef DEBUGPRINTS
-    printf("resived ACK with seq# = %d and ack# = %d\n\n", message.header.seq_number, message.header.ack_number);
+    printf("resived ACK with seq# = %d and ack# = %d\n\n", message->header.seq_number, message->header.ack_number);
     printf("END 3-way handshke:\n");
 #endif
 
+    //nothing of ours is in flight yet, the first data byte is the oldest unacknowledged
+    socket->snd_una = socket->seq_number;
     socket->state = ESTABLISHED;
 
     return 0;
 }
 
-
 int
-microtcp_shutdown (microtcp_sock_t *socket, int how) {
+microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address,
+                 socklen_t address_len)
+{
+    message_t message;
+    ssize_t received;
+
+    //a listening socket hands out its connections with microtcp_accept_connection()
+    if(socket->demux != NULL) return -1;
+#ifdef DEBUGPRINTS
+    printf("3-way handshke:\n\n");
+#endif
+    //we reseving the message initial message for the request to connect (SYN from the client)
+
+    received = recvfrom(socket->sd, &message, sizeof(message), 0, address, &address_len);
+    if(received == -1){
+        return -1;
+    }
+
+#ifdef DEBUGPRINTS
+    printf("resived SYN with seq# = %d\n", message.header.seq_number);
+#endif
+
+    //check that we revived the message correctly
+    if(check_received_segment(&message, received))return -1;
+
+    //check if we revived a header with only a ack in the control
+    if ((message.header.control & SYN_FLAG) != SYN_FLAG)return -1;
+
+    //save the address of the peer we are gona try to handshake will
+    memcpy(&(socket->peerAdress), address, sizeof(struct sockaddr));
+    socket->peerAdressLen = address_len;
+
+    //now we sent the SYN + ACK to accept the connection
+    srand((unsigned int)time(NULL) ^ (unsigned int)getpid());
+    if(syn_received(socket, &message) == -1) return -1;
+
+    //we resive a ack as the final step of the 3-way handshake, the SYN + ACK
+    //goes out again every RTO, backed off, until it comes
+    while(1){
+        if(wait_readable(socket, socket->rto_us) == -1){
+            if(errno == EINTR) continue;
+            if(errno != EAGAIN || socket->syn_retries >= MICROTCP_SYN_RETRIES) return -1;
+            socket->syn_retries++;
+            rto_backoff(socket);
+            if(send_syn_ack(socket) == -1) return -1;
+            continue;
+        }
+
+        received = recvfrom(socket->sd, &message, sizeof(message), 0, address, &address_len);
+        if(received == -1){
+            return -1;
+        }
+
+        //a segment that does not complete the handshake is skipped, like a
+        //path MTU probe sent right after an ACK of the client that got lost
+        if(check_received_segment(&message, received)) continue;
+
+        //our SYN + ACK got lost, the client asks again
+        if((message.header.control & (SYN_FLAG | ACK_FLAG)) == SYN_FLAG){
+            if(send_syn_ack(socket) == -1) return -1;
+            continue;
+        }
+        if(accept_complete(socket, &message) == 0) return 0;
+    }
+}
+
+int
+microtcp_listen (microtcp_sock_t *socket, int backlog)
+{
+    struct sockaddr_storage local;
+    socklen_t local_len = sizeof(local);
+
+    //only a bound socket listens, and only once
+    if(socket->state != LISTEN || socket->demux != NULL) return -1;
+
+    //a connection keeps its peer in a struct sockaddr and the table keys on
+    //it, only an IPv4 address fits there whole
+    if(getsockname(socket->sd, (struct sockaddr *) &local, &local_len) == -1) return -1;
+    if(local.ss_family != AF_INET){
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+
+    socket->demux = microtcp_demux_new(backlog > 0 ? backlog : 1);
+    if(socket->demux == NULL) return -1;
+    socket->demux->listener = socket;
+
+    //it reads the segments of every connection, of any size
+    if(segment_buffers(socket) == -1){
+        microtcp_demux_free(socket->demux);
+        socket->demux = NULL;
+        return -1;
+    }
+
+    srand((unsigned int)time(NULL) ^ (unsigned int)getpid());
+    return 0;
+}
+
+microtcp_sock_t *
+microtcp_accept_connection (microtcp_sock_t *socket, struct sockaddr *address,
+                            socklen_t *address_len, int flags)
+{
+    microtcp_demux_t *demux = socket->demux;
+    microtcp_sock_t *conn;
+    message_t *message;
+    uint64_t wait_us = (flags & MSG_DONTWAIT) ? 0 : MICROTCP_WAIT_FOREVER;
+
+    if(demux == NULL || socket->state != LISTEN) return NULL;
+
+    //everything the listening socket reads goes to the connections, a
+    //handshake that completes queues its connection
+    while(demux->accept_count == 0){
+        if(next_datagram(socket, &message, timer_wait(socket, wait_us)) == -1 && errno != EINTR && errno != EAGAIN){
+            return NULL;
+        }
+        run_timers(socket);
+        //without waiting it reads one batch at most, the rest is left for
+        //the connections to read into their own buffers
+        if(wait_us == 0 && socket->rx_next == socket->rx_count && demux->accept_count == 0){
+            errno = EAGAIN;
+            return NULL;
+        }
+    }
+
+    conn = demux->accepted[demux->accept_head];
+    demux->accept_head = (demux->accept_head + 1) % demux->backlog;
+    demux->accept_count--;
+    demux->pending--;
+
+    if(address != NULL && address_len != NULL){
+        memcpy(address, &(conn->peerAdress), min(*address_len, conn->peerAdressLen, sizeof(conn->peerAdress)));
+        *address_len = conn->peerAdressLen;
+    }
+
+    return conn;
+}
+
+int
+microtcp_listen_shards (microtcp_sock_t *shards, size_t count,
+                        const struct sockaddr *address, socklen_t address_len,
+                        int backlog)
+{
+    size_t i;
+    int err;
+
+    if(count > MICROTCP_SHARDS_MAX){
+        errno = EINVAL;
+        return -1;
+    }
+    //IPv4 only, as for microtcp_listen()
+    if(address->sa_family != AF_INET){
+        errno = EAFNOSUPPORT;
+        return -1;
+    }
+
+    for(i = 0; i < count; i++){
+        shards[i] = microtcp_socket(address->sa_family, SOCK_DGRAM, IPPROTO_UDP);
+        if(shards[i].state == INVALID) break;
+
+        //the kernel picks one of them by a hash of the peer's address and
+        //port, the same one for every datagram of a client
+        if(setsockopt(shards[i].sd, SOL_SOCKET, SO_REUSEPORT, &(int) {1}, sizeof(int)) == -1 ||
+           microtcp_bind(&shards[i], address, address_len) == -1 ||
+           microtcp_listen(&shards[i], backlog) == -1){
+            sock_release(&shards[i]);
+            close(shards[i].sd);
+            break;
+        }
+        //the ids of its connections name it for microtcp_steer_shards()
+        shards[i].demux->shard = i;
+    }
+    if(i == count) return 0;
+
+    //none of the ones before it has a connection yet, shutting it down
+    //closes its UDP socket and frees its table
+    err = errno;
+    while(i-- > 0) microtcp_shutdown(&shards[i], SHUT_RDWR);
+    errno = err;
+    return -1;
+}
+
+int
+microtcp_steer_shards (microtcp_sock_t *shards, size_t count)
+{
+    //the low byte of the id, wherever the host keeps it in future_use2
+    const uint32_t one = 1;
+    uint32_t low = offsetof(microtcp_header_t, future_use2) + (*(const uint8_t *) &one == 1 ? 0 : 3);
+
+    //the program sees the UDP payload, it returns the index of the socket
+    //in the group, the shard plus one of the id less one. An index past the
+    //last socket, for a datagram without an id, leaves it to the hash
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_B | BPF_ABS, low),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 2, 0),
+        BPF_STMT(BPF_ALU | BPF_SUB | BPF_K, 1),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+        BPF_STMT(BPF_RET | BPF_K, UINT32_MAX),
+    };
+    struct sock_fprog prog = { sizeof(code) / sizeof(code[0]), code };
+
+    if(count == 0 || shards[0].demux == NULL) return -1;
+
+    return setsockopt(shards[0].sd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+}
+
+//shuts a listening socket down, the connections nobody accepted or still
+//in their handshake are dropped, the accepted ones go on over the UDP
+//socket until they close
+static void
+listen_close(microtcp_sock_t *socket)
+{
+    microtcp_demux_t *demux = socket->demux;
+    microtcp_sock_t *conn;
+
+    while(demux->accept_count > 0){
+        conn = demux->accepted[demux->accept_head];
+        demux->accept_head = (demux->accept_head + 1) % demux->backlog;
+        demux->accept_count--;
+        conn_drop(conn);
+    }
+    while(demux->handshake_count > 0){
+        conn_drop(demux->handshaking[0]);
+    }
+
+    demux->listener = NULL;
+    sock_release(socket);
+    socket->state = CLOSED;
+#ifdef DEBUGPRINTS
+    printf("listening sock CLOESED\n");
+#endif
+}
+
+
+int
+microtcp_shutdown (microtcp_sock_t *socket, int how) {
     message_t message;
-    void *resbuff[MICROTCP_RECVBUF_LEN];
-    struct sockaddr resaddress;
-    socklen_t resaddressLen;
+    message_t finMessage;
 
-    /*client side*/
-    if(!socket->isServer) {
+    //the close handshake is the application's to run
+    engine_stop(socket);
+
+    /*client side, unless the peer closed first*/
+    if(!socket->isServer && socket->state != CLOSING_BY_PEER) {
 
 #ifdef DEBUGPRINTS
         printf("clinet stating shutdown\n\n");
 #endif
 
+        //everything handed to microtcp_send() goes out before the FIN
+        if(send_flush(socket) == -1){
+            return -1;
+        }
+
         //sending FIN + ACK to server
         message.header.seq_number = socket->seq_number;
         message.header.ack_number = socket->ack_number;
         message.header.control = FIN_FLAG | ACK_FLAG;
-        message.header.window = socket->curr_win_size;
+        message.header.window = window_field(socket);
         message.header.data_len = 0;
         message.header.future_use0 = 0;
         message.header.future_use1 = 0;
-        message.header.future_use2 = 0;
+        message.header.future_use2 = socket->conn_id;
         message.header.checksum = 0;
-        //message.payload = NULL;
-        message.header.checksum = crc32((const uint8_t *) &message, sizeof(message));
+        message.header.checksum = header_checksum(&message.header);
 
-        if(sendto(socket->sd, &message, sizeof(message), 0, &(socket->peerAdress), socket->peerAdressLen) == -1){
+        if(sendto(socket->sd, &message, message_len(&message), 0, &(socket->peerAdress), socket->peerAdressLen) == -1){
             return -1;
         }
 #ifdef DEBUGPRINTS
@@ -325,20 +1295,11 @@ microtcp_shutdown (microtcp_sock_t *socket, int how) {
 #endif
         socket->seq_number++;
 
-        //now we wait for the ACK of our FIN + ACK
-        if( recvfrom(socket->sd, &resbuff, socket->curr_win_size, 0, &resaddress, &resaddressLen) == -1){
+        //now we wait for the ACK of our FIN + ACK, resending it if it gets lost
+        finMessage = message;
+        if(wait_close_segment(socket, &message, ACK_FLAG, &finMessage) == -1){
             return -1;
         }
-        memcpy(&message, resbuff, sizeof(message_t));
-
-        //check that we revived the message correctly
-        if (check_resived_checksum(message))return -1;
-
-        //check if we revived a header with only a ack in the control
-        if ((message.header.control & ACK_FLAG) != ACK_FLAG)return -1;
-
-        //check the ACK
-        if (message.header.ack_number != socket->seq_number) return -1;
 
 #ifdef DEBUGPRINTS
         printf("resiveed ACK with seq# = %d, ack# = %d\n\n", message.header.seq_number, message.header.ack_number);
@@ -353,20 +1314,11 @@ microtcp_shutdown (microtcp_sock_t *socket, int how) {
         printf("client sock CLOESED_BY_HOST\n");
 #endif
 
-        //now we wait for the FIN + ACK
-        if( recvfrom(socket->sd, &resbuff, socket->curr_win_size, 0, &resaddress, &resaddressLen) == -1){
+        //now we wait for the FIN + ACK, the server resends it if it gets lost
+        if((message.header.control & FIN_FLAG) != FIN_FLAG &&
+           wait_close_segment(socket, &message, FIN_FLAG | ACK_FLAG, NULL) == -1){
             return -1;
         }
-        memcpy(&message, resbuff, sizeof(message_t));
-
-        //check that we revived the message correctly
-        if (check_resived_checksum(message))return -1;
-
-        //check if we revived a header with only a ack in the control
-        if ((message.header.control & FIN_FLAG | ACK_FLAG) != (FIN_FLAG | ACK_FLAG) )return -1;
-
-        //check the ACK
-        if (message.header.ack_number != socket->seq_number) return -1;
 
 #ifdef DEBUGPRINTS
         printf("resiveed FIN + ACK  with seq# = %d and ack = %d\n\n", message.header.seq_number, message.header.ack_number);
@@ -380,16 +1332,15 @@ microtcp_shutdown (microtcp_sock_t *socket, int how) {
         message.header.seq_number = socket->seq_number;
         message.header.ack_number = socket->ack_number;
         message.header.control = ACK_FLAG;
-        message.header.window = socket->curr_win_size;
+        message.header.window = window_field(socket);
         message.header.data_len = 0;
         message.header.future_use0 = 0;
         message.header.future_use1 = 0;
-        message.header.future_use2 = 0;
+        message.header.future_use2 = socket->conn_id;
         message.header.checksum = 0;
-        //message.payload = NULL;
-        message.header.checksum = crc32((const uint8_t *) &message, sizeof(message));
+        message.header.checksum = header_checksum(&message.header);
 
-        if( sendto(socket->sd, &message, sizeof(message), 0, &(socket->peerAdress), socket->peerAdressLen) == -1){
+        if( sendto(socket->sd, &message, message_len(&message), 0, &(socket->peerAdress), socket->peerAdressLen) == -1){
             return -1;
         }
 #ifdef DEBUGPRINTS
@@ -397,7 +1348,10 @@ microtcp_shutdown (microtcp_sock_t *socket, int how) {
 #endif
         socket->seq_number++;
 
-        free(socket->recvbuf);
+        //answer the FIN + ACK again for a while, in case our ACK gets lost
+        close_linger(socket, &message);
+
+        sock_release(socket);
 
         socket->state = CLOSED;
 #ifdef DEBUGPRINTS
@@ -411,7 +1365,12 @@ microtcp_shutdown (microtcp_sock_t *socket, int how) {
 
 
 
-    /*server side*/
+    /*server side, or a client whose peer closed first*/
+
+    if(socket->state == LISTEN && socket->demux != NULL){
+        listen_close(socket);
+        return 0;
+    }
 
 #ifdef DEBUGPRINTS
     printf("srver stating shutdown\n\n");
@@ -443,20 +1402,24 @@ microtcp_shutdown (microtcp_sock_t *socket, int how) {
 
     if(socket->state == CLOSING_BY_PEER) {
 
+            //everything handed to microtcp_send() goes out before the FIN
+            if(send_flush(socket) == -1){
+                return -1;
+            }
+
             //sending ACK to server
             message.header.seq_number = socket->seq_number;
             message.header.ack_number = socket->ack_number;
             message.header.control = ACK_FLAG;
-            message.header.window = socket->curr_win_size;
+            message.header.window = window_field(socket);
             message.header.data_len = 0;
             message.header.future_use0 = 0;
             message.header.future_use1 = 0;
-            message.header.future_use2 = 0;
+            message.header.future_use2 = socket->conn_id;
             message.header.checksum = 0;
-            //message.payload = NULL;
-            message.header.checksum = crc32((const uint8_t *) &message, sizeof(message));
+            message.header.checksum = header_checksum(&message.header);
 
-            if (sendto(socket->sd, &message, sizeof(message), 0, &(socket->peerAdress), socket->peerAdressLen) == -1) {
+            if (sendto(socket->sd, &message, message_len(&message), 0, &(socket->peerAdress), socket->peerAdressLen) == -1) {
                 return -1;
             }
         #ifdef DEBUGPRINTS
@@ -473,16 +1436,15 @@ microtcp_shutdown (microtcp_sock_t *socket, int how) {
             message.header.seq_number = socket->seq_number;
             message.header.ack_number = socket->ack_number;
             message.header.control = FIN_FLAG | ACK_FLAG;
-            message.header.window = socket->curr_win_size;
+            message.header.window = window_field(socket);
             message.header.data_len = 0;
             message.header.future_use0 = 0;
             message.header.future_use1 = 0;
-            message.header.future_use2 = 0;
+            message.header.future_use2 = socket->conn_id;
             message.header.checksum = 0;
-            //message.payload = NULL;
-            message.header.checksum = crc32((const uint8_t *) &message, sizeof(message));
+            message.header.checksum = header_checksum(&message.header);
 
-            if (sendto(socket->sd, &message, sizeof(message), 0, &(socket->peerAdress), socket->peerAdressLen) == -1) {
+            if (sendto(socket->sd, &message, message_len(&message), 0, &(socket->peerAdress), socket->peerAdressLen) == -1) {
                 return -1;
             }
         #ifdef DEBUGPRINTS
@@ -490,20 +1452,11 @@ microtcp_shutdown (microtcp_sock_t *socket, int how) {
         #endif
             socket->seq_number++;
 
-            //now we wait for the ACK
-            if (recvfrom(socket->sd, &resbuff, socket->curr_win_size, 0, &resaddress, &resaddressLen) == -1) {
+            //now we wait for the ACK, resending the FIN + ACK if it gets lost
+            finMessage = message;
+            if (wait_close_segment(socket, &message, ACK_FLAG, &finMessage) == -1) {
                 return -1;
             }
-            memcpy(&message, resbuff, sizeof(message_t));
-
-            //check that we revived the message correctly
-            if (check_resived_checksum(message))return -1;
-
-            //check if we revived a header with only a ack in the control
-            if ((message.header.control & ACK_FLAG) != (ACK_FLAG))return -1;
-
-            //check the ACK
-            if (message.header.ack_number != socket->seq_number) return -1;
 
         #ifdef DEBUGPRINTS
             printf("resiveed ACK  with seq# = %d, ack# = %d\n\n", message.header.seq_number, message.header.ack_number);
@@ -512,7 +1465,7 @@ microtcp_shutdown (microtcp_sock_t *socket, int how) {
             //save the seq# we got from the client
             socket->ack_number = message.header.seq_number + 1;
 
-            free(socket->recvbuf);
+            sock_release(socket);
 
             socket->state = CLOSED;
 
@@ -527,361 +1480,1526 @@ microtcp_shutdown (microtcp_sock_t *socket, int how) {
     return 0;
 }
 
-ssize_t
-microtcp_send (microtcp_sock_t *socket, const void *buffer, size_t length,
-               int flags)
+//the in-flight segment pos places after the oldest one
+static microtcp_segment_t *
+inflight_at(microtcp_sock_t *socket, size_t pos)
 {
-    size_t remaining = length;
-    ssize_t data_sent = 0;
-    ssize_t bytes_to_send;
-    size_t chunks;
-    size_t flow_ctrl_win = socket->init_win_size;
-    size_t extraChunkSize;
-    size_t extraPayload  = 0;
-    size_t maxPayload = 0;
+    return &socket->inflight[(socket->inflight_head + pos) & (socket->inflight_len - 1)];
+}
 
-    message_t message;
+//end of the seq# space a segment occupies
+static size_t
+segment_end(const microtcp_segment_t *seg)
+{
+    return seg->seq_number + seg->len;
+}
 
-    size_t i = 0;
+//cuts in-flight segment i after len bytes, the rest becomes a segment of
+//its own right behind it, the ring must have a free slot. What went out
+//whole is taken as lost, both pieces count as never sent.
+static void
+inflight_split(microtcp_sock_t *socket, size_t i, size_t len)
+{
+    microtcp_segment_t *seg;
+    microtcp_segment_t *rest;
+    size_t j;
 
-    int tripleACKCounter = 0;
-    int retransmission_flag = 0;
-    socket->comgestion_state = slow_start;
-    socket->cwnd = MICROTCP_MSS;
-    socket->ssthresh = MICROTCP_WIN_SIZE;
-
-    //While there is still data to sent
-    while(data_sent < length){
-        bytes_to_send = min( remaining , flow_ctrl_win , socket->cwnd);
-        printf("\n\n\nthe winner is %zu\n\n\n", bytes_to_send);
-        chunks = bytes_to_send / MICROTCP_MSS;
-        extraChunkSize = bytes_to_send % MICROTCP_MSS;
-        if(chunks == 0){
-            perror("error with chunk size cant be zero");
-            return -1;
-        }
-        maxPayload = ((bytes_to_send - extraChunkSize)/chunks) - sizeof(message.header);
-        tripleACKCounter = 0;
-        size_t excpectedACK[chunks + 1];
+    for(j = socket->inflight_count; j > i + 1; j--){
+        *inflight_at(socket, j) = *inflight_at(socket, j - 1);
+    }
+    socket->inflight_count++;
+
+    seg = inflight_at(socket, i);
+    rest = inflight_at(socket, i + 1);
+    *rest = *seg;
+    rest->seq_number += len;
+    rest->payload += len;
+    rest->len -= len;
+    rest->payload_crc = checksum_payload(rest->payload, rest->len);
+    seg->len = len;
+    seg->payload_crc = checksum_payload(seg->payload, seg->len);
+    seg->sent_us = rest->sent_us = 0;
+    seg->retransmits = rest->retransmits = 0;
+}
 
+/*
+ * Segments of the current size stopped getting through: the path got
+ * smaller, or our own interface did, which sendmmsg() reports as EMSGSIZE.
+ * The MSS goes back to MICROTCP_MSS (MICROTCP_MIN_MSS if it already was
+ * there) with a new search up from it, and the segments in flight that are
+ * bigger are cut again so their retransmissions fit.
+ */
+static void
+pmtu_black_hole(microtcp_sock_t *socket)
+{
+    size_t max;
+    size_t i;
+    microtcp_segment_t *seg;
+
+    socket->mss = socket->mss > MICROTCP_MSS ? MICROTCP_MSS : MICROTCP_MIN_MSS;
+    socket->probe_high = socket->max_mss;
+    socket->probe_size = 0;
+    socket->probe_tries = 0;
+    socket->probe_us = now_us();
 #ifdef DEBUGPRINTS
-        printf("\nchungs = %zu\n", chunks);
-        printf("\nmaxPayload = %zu\n", maxPayload);
-        printf("\nextraChunkSize = %zu\n", extraChunkSize);
+    printf("segments are not getting through, mss back to %zu\n", socket->mss);
 #endif
-        //Sending the chunks
-        for(i = 0; i < chunks; i++){
 
-            retransmission_flag = 0;
+    max = socket->mss - sizeof(microtcp_header_t);
+    for(i = 0; i < socket->inflight_count && socket->inflight_count < socket->inflight_len; i++){
+        seg = inflight_at(socket, i);
+        if(!seg->sacked && seg->len > max) inflight_split(socket, i, max);
+    }
+}
 
-#ifdef DEBUGPRINTS
-            printf("Sending %zu chunk\n",i);
-#endif
-            message.header.seq_number = socket->seq_number;
-            message.header.ack_number = socket->ack_number;
-            message.header.control = 0;
-            message.header.window = 0;
-            message.header.data_len = maxPayload ;
-            message.header.future_use0 = 0;
-            message.header.future_use1 = 0;
-            message.header.future_use2 = 0;
-            message.header.checksum = 0;
-            memcpy(message.payload, buffer + i * maxPayload ,  message.header.data_len);
-            message.header.checksum = crc32((const uint8_t *) &message, sizeof(message) + message.header.data_len);
-            printf("\ncheckum = %u\n", message.header.checksum);
-            extraPayload += sizeof(microtcp_header_t);
+/*
+ * Hands the in-flight segments [first, first + count) (positions counted from
+ * the ring head) to the kernel with as few sendmmsg calls as possible, one per
+ * MICROTCP_SEND_BATCH segments. New segments and retransmissions go out
+ * through here alike.
+ *
+ * Every datagram is gathered from two iovec entries, the header and a pointer
+ * straight to the payload in the send buffer, so the payload is never copied.
+ * Its CRC is cached in the descriptor so only the header has to be
+ * checksummed per send.
+ *
+ * returns:
+ *      the number of segments sent
+ *      -1 for failure
+ */
+static ssize_t
+send_segment_batch(microtcp_sock_t *socket, size_t first, size_t count)
+{
+    microtcp_header_t headers[MICROTCP_SEND_BATCH];
+    struct mmsghdr msgs[MICROTCP_SEND_BATCH];
+    struct iovec iov[MICROTCP_SEND_BATCH][2];
+    microtcp_segment_t *segs[MICROTCP_SEND_BATCH];
+    size_t sent = 0;
+    size_t batch;
+    size_t done;
+    size_t j;
+    uint64_t now;
+    int ret;
+    int too_big = 0;
+
+    while(sent < count){
+        batch = count - sent;
+        if(batch > MICROTCP_SEND_BATCH) batch = MICROTCP_SEND_BATCH;
+
+        //build every datagram of the batch first
+        for(j = 0; j < batch; j++){
+            microtcp_segment_t *seg = inflight_at(socket, first + sent + j);
+            microtcp_header_t *header = &headers[j];
+
+            header->seq_number = seg->seq_number;
+            header->ack_number = socket->ack_number;
+            header->control = 0;
+            header->window = window_field(socket);
+            header->data_len = seg->len;
+            stamp_header(socket, header);
+            header->future_use2 = socket->conn_id;
+            header->checksum = checksum_finish(seg->payload_crc, seg->len, header);
+
+            iov[j][0].iov_base = header;
+            iov[j][0].iov_len = sizeof(*header);
+            iov[j][1].iov_base = (void *) seg->payload;
+            iov[j][1].iov_len = seg->len;
+
+            memset(&msgs[j], 0, sizeof(msgs[j]));
+            msgs[j].msg_hdr.msg_name = &socket->peerAdress;
+            msgs[j].msg_hdr.msg_namelen = socket->peerAdressLen;
+            msgs[j].msg_hdr.msg_iov = iov[j];
+            msgs[j].msg_hdr.msg_iovlen = 2;
+            segs[j] = seg;
+        }
 
-            if(sendto(socket->sd, &message, (sizeof(message.header) + message.header.data_len), 0, &(socket->peerAdress), socket->peerAdressLen)  == -1){
-                perror("error in sentTo in send\n");
+        //sendmmsg may take fewer datagrams than asked so keep going until the batch is out
+        done = 0;
+        while(done < batch){
+            ret = sendmmsg(socket->sd, msgs + done, batch - done, 0);
+            if(ret == -1){
+                if(errno == EINTR) continue;
+                //the rest counts as sent and lost, it is resent cut smaller
+                if(errno == EMSGSIZE){
+                    too_big = 1;
+                    break;
+                }
+                perror("error in sendmmsg in send\n");
+                return -1;
             }
-            socket->packets_send++;
-            socket->bytes_send += message.header.data_len;
-            socket->seq_number += message.header.data_len;
-            excpectedACK[i] = socket->seq_number + 1;
+            done += ret;
+        }
 
+        now = now_us();
+        for(j = 0; j < batch; j++){
+            if(segs[j]->sent_us != 0) segs[j]->retransmits++;
+            segs[j]->sent_us = now;
+            segs[j]->tx_delivered = socket->delivered;
+            segs[j]->tx_delivered_us = socket->delivered_us;
+            segs[j]->tx_first_sent_us = socket->first_sent_us;
+            segs[j]->tx_app_limited = socket->app_limited != 0;
+            socket->packets_send++;
+            socket->bytes_send += segs[j]->len;
 #ifdef DEBUGPRINTS
-            for(size_t j = 0;j < message.header.data_len;j++) {
-                printf("%c", ((char *) message.payload)[j]);
-            }
-            printf("\nChunk %zu sent\n",i);
+            printf("Chunk sent with seq# = %zu (retransmits %u)\n", segs[j]->seq_number, segs[j]->retransmits);
 #endif
         }
+        sent += batch;
 
-        //Extra chunk
-        if(bytes_to_send % MICROTCP_MSS){
-            chunks++;
+        //the positions of the rest change once the segments are cut again
+        if(too_big){
+            pmtu_black_hole(socket);
+            break;
+        }
+    }
 
-#ifdef DEBUGPRINTS
-            printf("\nextraPayload %lu\n", extraPayload);
-#endif
-            message.header.seq_number = socket->seq_number;
-            message.header.ack_number = socket->ack_number;
-            message.header.data_len = extraChunkSize + extraPayload;
-            message.header.checksum = 0;
-            memcpy(message.payload, buffer + (i * maxPayload), message.header.data_len);
-            message.header.checksum = crc32((const uint8_t *) &message, sizeof(message) + message.header.data_len);
+    return sent;
+}
 
+/*
+ * Cuts as much of the queued data into segments as the flow and congestion
+ * windows allow and sends all of them with one send_segment_batch() call.
+ *
+ * returns:
+ *      0 for success
+ *      -1 for failure
+ */
+static int
+transmit_new(microtcp_sock_t *socket)
+{
+    size_t maxPayload = socket->mss - sizeof(microtcp_header_t);
+    size_t in_flight = socket->seq_number - socket->snd_una;
+    size_t usable = min(socket->peer_win_size, socket->cc->get_cwnd(socket), SIZE_MAX);
+    size_t queued = 0;
+    size_t pending;
+    size_t len;
+    size_t idx;
+    microtcp_segment_t *seg;
+    uint64_t rate = socket->cc->pacing_rate(socket);
+    uint64_t now = now_us();
+
+    usable = usable > in_flight ? usable - in_flight : 0;
+    //nothing in flight and a closed window: once the persist timer is due a
+    //single byte goes out as a window probe, its retransmissions keep probing
+    if(usable == 0 && socket->inflight_count == 0 && socket->sndbuf_nxt != socket->sndbuf_end){
+        if(socket->persist_us == 0) socket->persist_us = now + socket->rto_us;
+        if(now >= socket->persist_us){
 #ifdef DEBUGPRINTS
-            printf("Sending extra %zu chunk\n",i);
-            for(size_t j = 0;j < message.header.data_len;j++) {
-                printf("%c", ((char *) message.payload)[j]);
-            }
+            printf("peer window closed, sending a window probe\n");
 #endif
+            usable = 1;
+            socket->persist_us = 0;
+        }
+    }
 
-            if(sendto(socket->sd, &message, sizeof(message.header) + message.header.data_len, 0, &(socket->peerAdress), socket->peerAdressLen)  == -1){
-                perror("error in sentTo in send\n");
-            }
-            socket->packets_send++;
-            socket->bytes_send += message.header.data_len;
-            socket->seq_number += message.header.data_len;
-            excpectedACK[chunks - 1] = socket->seq_number + 1;
+    if(pmtu_probe(socket, now) == -1) return -1;
 
-#ifdef DEBUGPRINTS
-            printf("\nChunk %zu sent\n",i);
-#endif
+    //after an idle period the delivery rate intervals start over
+    if(socket->inflight_count == 0){
+        socket->first_sent_us = now;
+        socket->delivered_us = now;
+    }
+    //a paced sender builds up no credit while it has nothing to send
+    if(rate != 0 && socket->pacing_next_us < now){
+        socket->pacing_next_us = now;
+    }
+
+    while(socket->inflight_count < socket->inflight_len){
+        pending = socket->sndbuf_end - socket->sndbuf_nxt;
+        len = min(maxPayload, pending, SIZE_MAX);
+        if(len == 0) break;
+        //Nagle, a partial segment waits while data is in flight so the small
+        //writes of the application add up to full segments
+        if(len < maxPayload && socket->inflight_count > 0) break;
+        //paced, only a small burst may run ahead of the clock
+        if(rate != 0 && socket->pacing_next_us > now + MICROTCP_PACING_BURST * maxPayload * 1000000 / rate) break;
+        //do not cut runts out of a small window while data is in flight
+        if(len > usable){
+            if(usable == 0 || socket->inflight_count > 0) break;
+            len = usable;
         }
+        //a segment never wraps around the end of the send buffer
+        idx = socket->sndbuf_nxt & (socket->sndbuf_len - 1);
+        if(len > socket->sndbuf_len - idx) len = socket->sndbuf_len - idx;
+
+        seg = inflight_at(socket, socket->inflight_count);
+        seg->seq_number = socket->seq_number;
+        seg->payload = socket->sndbuf + idx;
+        seg->len = len;
+        seg->retransmits = 0;
+        seg->sent_us = 0;
+        seg->sacked = 0;
+        seg->payload_crc = checksum_payload(seg->payload, len);
+        socket->inflight_count++;
+
+        socket->seq_number += len;
+        socket->sndbuf_nxt += len;
+        usable -= len;
+        queued++;
+        if(rate != 0) socket->pacing_next_us += len * 1000000 / rate;
+    }
 
-        //resive asks
-        void* resivebuff[MICROTCP_RECVBUF_LEN];
-        message_t ackMesege;
-
-        //Here the problem is that the retransmission should be out of the for loop 
-        //Because if the client sends an ACK and wants retransmission the receiver will see it 
-        //But wont retransmitt until he receives all the acks for the packets he sent
-        //The retransmissions need to also have their own ACK receivers 
-        //We tried doing it but the code becomes unreadable and it adds 200-300 lines of code
-
-        for(i = 0; i < chunks; i++){
-            struct timeval timeout;
-            timeout. tv_sec = 0;
-            timeout. tv_usec = MICROTCP_ACK_TIMEOUT_US;
-            if ( setsockopt( socket->sd , SOL_SOCKET, SO_RCVTIMEO , & timeout , sizeof( struct timeval)) < 0) {
-                perror(" error in setsockopt\n");
-            }
+    //out of data with room left in the window, the application is the
+    //bottleneck until everything in flight now has been delivered
+    if(socket->sndbuf_nxt == socket->sndbuf_end && usable > 0){
+        socket->app_limited = socket->delivered + (socket->seq_number - socket->snd_una) + 1;
+    }
 
-            ssize_t bytesReceived = recvfrom(socket->sd, &resivebuff, sizeof (message_t), 0, &socket->peerAdress, &socket->peerAdressLen);
+    //Sending the new chunks, one syscall for all of them
+    if(queued && send_segment_batch(socket, socket->inflight_count - queued, queued) == -1){
+        return -1;
+    }
+
+    return 0;
+}
 
-            if (bytesReceived < 0) {
-                if (errno == EWOULDBLOCK || errno == EAGAIN) {
-                    printf("Receive timeout occurred\n");
-                    socket->packets_lost++;
+/*
+ * Delivery rate estimation: every transmission snapshots how much had been
+ * delivered by then. Of the segments one ACK delivers, the one sent last
+ * gives the sample: the bytes delivered since its snapshot over the longer
+ * of its send and ACK intervals.
+ */
+typedef struct
+{
+    int valid;
+    uint64_t sent_us;
+    uint64_t prior_delivered;
+    uint64_t prior_delivered_us;
+    uint64_t first_sent_us;
+    int app_limited;
+} rate_snapshot_t;
+
+//counts a segment as delivered, cumulatively or by a SACK
+static void
+rate_delivered(microtcp_sock_t *socket, const microtcp_segment_t *seg, rate_snapshot_t *rs, uint64_t now)
+{
+    socket->delivered += seg->len;
+    socket->delivered_us = now;
+
+    if(!rs->valid || seg->sent_us >= rs->sent_us){
+        rs->valid = 1;
+        rs->sent_us = seg->sent_us;
+        rs->prior_delivered = seg->tx_delivered;
+        rs->prior_delivered_us = seg->tx_delivered_us;
+        rs->first_sent_us = seg->tx_first_sent_us;
+        rs->app_limited = seg->tx_app_limited;
+        socket->first_sent_us = seg->sent_us;
+    }
+}
 
-                    if(socket->comgestion_state == slow_start){
-                        socket->ssthresh = socket->cwnd/2;
-                        socket->cwnd = MICROTCP_MSS;
-                        tripleACKCounter = 0;
-                    }else if(socket->comgestion_state == congestion_avoidance){
-#ifdef DEBUGPRINTS
-                        printf("\nFrom congestion avoidance to slow start\n");
-#endif
-                        socket->comgestion_state = slow_start;
-                        socket->ssthresh = socket->cwnd/2;
-                        socket->cwnd = MICROTCP_MSS;
-                        tripleACKCounter = 0;
-                    }else if(socket->comgestion_state == fast_recovery){
-#ifdef DEBUGPRINTS
-                        printf("\nFrom fast recovery to slow start\n");
-#endif
-                        socket->comgestion_state = slow_start;
-                        socket->ssthresh = socket->cwnd/2;
-                        socket->cwnd = MICROTCP_MSS;
-                        tripleACKCounter = 0;
-                    }
-
-                    retransmission_flag = 1;
-                } else {
-                    //recfrom fail
-                    return -1;
-                }
-            }
+//fills the delivery fields of the sample of one ACK
+static void
+rate_sample(microtcp_sock_t *socket, const rate_snapshot_t *rs, microtcp_ack_sample_t *sample)
+{
+    uint64_t send_elapsed;
+    uint64_t ack_elapsed;
+    uint64_t interval;
 
-            printf("\nReceived ACK %zu\n", i);
+    if(socket->app_limited != 0 && socket->delivered > socket->app_limited){
+        socket->app_limited = 0;
+    }
 
-            memcpy(&ackMesege, resivebuff, sizeof(message_t));
+    sample->delivered = socket->delivered;
+    sample->prior_delivered = 0;
+    sample->delivery_rate = 0;
+    sample->app_limited = 0;
+    if(!rs->valid) return;
+
+    sample->prior_delivered = rs->prior_delivered;
+    sample->app_limited = rs->app_limited;
+    send_elapsed = rs->sent_us - rs->first_sent_us;
+    ack_elapsed = socket->delivered_us - rs->prior_delivered_us;
+    interval = send_elapsed > ack_elapsed ? send_elapsed : ack_elapsed;
+    if(interval > 0){
+        sample->delivery_rate = (socket->delivered - rs->prior_delivered) * 1000000 / interval;
+    }
+}
 
-            //If we dont receive an ACK
-            if ((ackMesege.header.control & ACK_FLAG) != (ACK_FLAG) )return -1;
+//marks the in-flight segments covered by the SACK blocks of an ACK
+static void
+sack_mark(microtcp_sock_t *socket, const message_t *message, rate_snapshot_t *rs, uint64_t now)
+{
+    uint32_t blocks = message->header.data_len / (2 * sizeof(uint32_t));
+    uint32_t edge[2];
+    size_t left;
+    size_t right;
+    size_t i;
+    uint32_t b;
+    microtcp_segment_t *seg;
+
+    for(b = 0; b < blocks; b++){
+        memcpy(edge, message->payload + b * sizeof(edge), sizeof(edge));
+        left = seq_expand(socket->snd_una, edge[0]);
+        right = seq_expand(socket->snd_una, edge[1]);
+        if(right <= left || left < socket->snd_una || right > socket->seq_number) continue;
+
+        for(i = 0; i < socket->inflight_count; i++){
+            seg = inflight_at(socket, i);
+            if(seg->seq_number >= right) break;
+            if(seg->seq_number >= left && segment_end(seg) <= right && !seg->sacked){
+                seg->sacked = 1;
+                rate_delivered(socket, seg, rs, now);
+            }
+        }
+    }
+}
 
-            flow_ctrl_win = message.header.window;
+/*
+ * Resends the holes of the scoreboard during fast recovery: the oldest
+ * segment, and every segment not SACKed with at least 3 SACKed segments
+ * above it. Each is sent at most once per recovery, runs of adjacent holes
+ * go out in one batch.
+ *
+ * returns:
+ *      0 for success
+ *      -1 for failure
+ */
+static int
+sack_retransmit(microtcp_sock_t *socket)
+{
+    size_t limit = 1;
+    size_t sacked_above = 0;
+    size_t first;
+    size_t i;
+    microtcp_segment_t *seg;
+
+    //anything below the 3rd highest SACKed segment counts as lost
+    for(i = socket->inflight_count; i > 0; i--){
+        if(inflight_at(socket, i - 1)->sacked && ++sacked_above == 3){
+            limit = i - 1;
+            break;
+        }
+    }
+    if(limit == 0) limit = 1;
+
+    i = 0;
+    while(i < limit && i < socket->inflight_count){
+        seg = inflight_at(socket, i);
+        if(seg->sacked || seg->sent_us >= socket->recovery_us){
+            i++;
+            continue;
+        }
 
-            socket->packets_received++;
-            socket->bytes_received++;
+        first = i;
+        while(i < limit && i < socket->inflight_count){
+            seg = inflight_at(socket, i);
+            if(seg->sacked || seg->sent_us >= socket->recovery_us) break;
+            socket->packets_lost++;
+            socket->bytes_lost += seg->len;
+            i++;
+        }
+        if(send_segment_batch(socket, first, i - first) == -1){
+            return -1;
+        }
+    }
 
+    return 0;
+}
 
-            //the clients buffer is full
-            while (flow_ctrl_win == 0){
-                struct timeval timeout;
-                timeout. tv_sec = 100;
-                timeout. tv_usec = MICROTCP_ACK_TIMEOUT_US;
-                if ( setsockopt( socket->sd , SOL_SOCKET, SO_RCVTIMEO , & timeout , sizeof( struct timeval)) < 0) {
-                    perror(" error in setsockopt\n");
-                }
-                if(recvfrom(socket->sd, socket->recvbuf, MICROTCP_RECVBUF_LEN, 0, &socket->peerAdress, &socket->peerAdressLen) < 0){
-                    printf("we got time out FFFFF\n");                                                                            ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////!!!!!!!!!!!!!!!!!!!!!!!!!
+/*
+ * Updates the sender with one ACK from the peer: slides the window over the
+ * segments it covers, runs the congestion control and resends only the
+ * segments the receiver is missing on a triple duplicate or partial ACK.
+ *
+ * returns:
+ *      0 for success
+ *      -1 for failure
+ */
+static int
+process_ack(microtcp_sock_t *socket, const message_t *message)
+{
+    const microtcp_header_t *header = &message->header;
+    size_t ack = seq_expand(socket->snd_una, header->ack_number);
+    microtcp_segment_t *seg;
+    microtcp_ack_sample_t sample;
+    rate_snapshot_t rs;
+    uint64_t sent_us = 0;
+
+    memset(&sample, 0, sizeof(sample));
+    sample.now_us = now_us();
+    rs.valid = 0;
+
+    //the answer to a path MTU probe says nothing about the data
+    if(header->control & PROBE_FLAG){
+        pmtu_probe_acked(socket, message);
+        return 0;
+    }
 
-                }
-                memcpy(&message,socket->recvbuf,sizeof(microtcp_header_t));
-                socket->packets_received++;
-                socket->bytes_received++;
+    socket->packets_received++;
+    socket->peer_win_size = (size_t) header->window << socket->snd_wscale;
+    //an open window stops the persist timer
+    if(socket->peer_win_size > 0) socket->persist_us = 0;
+    //new data acknowledged, or a closed window answering a probe: the peer is there
+    if(socket->peer_win_size == 0 || ack > socket->snd_una){
+        socket->rto_retries = 0;
+    }
 
-                if ((ackMesege.header.control & ACK_FLAG) != (ACK_FLAG) )continue;
-                flow_ctrl_win = message.header.window;
-            }
+    //an in-order ACK carries the TSval we echo back
+    if(socket->ts_ok && seq_expand(socket->ack_number, header->seq_number) == socket->ack_number &&
+       (int32_t) (header->future_use0 - socket->ts_recent) >= 0){
+        socket->ts_recent = header->future_use0;
+    }
 
+    //the scoreboard is updated first so a hole is never resent needlessly
+    if(header->control & SACK_FLAG){
+        sack_mark(socket, message, &rs, sample.now_us);
+    }
 
-            //If the ack we receive is not what we expected
-            if (ackMesege.header.ack_number != excpectedACK[i]) {
-                tripleACKCounter++;
-                //Triple Ack Handler
-                if(tripleACKCounter >= 3) {
-                    printf("%s AND we got worng header header ack so retrasmit, a header ack: %u != soket seq: %zu \n", socket->isServer ? "i am server" : "i am client", ackMesege.header.ack_number, excpectedACK[i]);
+    if(ack > socket->snd_una && ack <= socket->seq_number){
+        //new data acknowledged, drop every segment it covers and free their buffer space
+        while(socket->inflight_count > 0){
+            seg = inflight_at(socket, 0);
+            if(segment_end(seg) > ack) break;
+            //Karn's rule: a retransmitted segment gives no RTT sample
+            sent_us = seg->retransmits == 0 ? seg->sent_us : 0;
+            if(!seg->sacked) rate_delivered(socket, seg, &rs, sample.now_us);
+            socket->sndbuf_una += seg->len;
+            socket->inflight_head = (socket->inflight_head + 1) & (socket->inflight_len - 1);
+            socket->inflight_count--;
+        }
+        sample.acked = ack - socket->snd_una;
+        socket->snd_una = ack;
+        socket->dup_acks = 0;
+        //the echoed TSval times even retransmitted segments, without it
+        //only a segment that was sent once gives a sample
+        if(socket->ts_ok && header->future_use1 != 0){
+            sample.rtt_us = (uint32_t) (ts_now() - header->future_use1);
+        }else if(sent_us != 0){
+            sample.rtt_us = sample.now_us - sent_us;
+        }
+        if(sample.rtt_us != 0){
+            rtt_sample(socket, sample.rtt_us);
+        }
 
-                    if(socket->comgestion_state != fast_recovery){
-#ifdef DEBUGPRINTS
-                        printf("\nFrom slow start or congestion avoidance to fast recovery\n");
-#endif
-                        socket->comgestion_state = fast_recovery;
-                        socket->ssthresh = socket->cwnd/2;
-                        socket->cwnd = socket->ssthresh + 3 * MICROTCP_MSS;
-                    }else{
-                        socket->cwnd += MICROTCP_MSS;
-                    }
-                    retransmission_flag = 1;
+        //after a timeout everything sent before it is presumed lost, so
+        //each partial ACK resends the next hole without another timeout
+        if(socket->rto_recovery){
+            if(ack >= socket->recover){
+                socket->rto_recovery = 0;
+            }else if(socket->inflight_count > 0 && inflight_at(socket, 0)->retransmits == 0){
+                socket->packets_lost++;
+                socket->bytes_lost += inflight_at(socket, 0)->len;
+                if(send_segment_batch(socket, 0, 1) == -1){
+                    return -1;
                 }
             }
+        }
 
-            //after each succeefull ack add one to the cwd
-            if(socket->comgestion_state == slow_start) {
-                socket->cwnd += MICROTCP_MSS;
-                if(socket->cwnd >= socket->ssthresh){
-#ifdef  DEBUGPRINTS
-                    printf("\nFrom slow start to congestion avoidance\n");
-#endif
-
-                    socket->comgestion_state = congestion_avoidance;
-                }
-            }else if(socket->comgestion_state == congestion_avoidance){
-                socket->cwnd += MICROTCP_MSS + (MICROTCP_MSS/socket->cwnd);
-                tripleACKCounter =  0;
-            }else if(socket->comgestion_state == fast_recovery){
+        if(socket->comgestion_state == fast_recovery){
+            if(ack >= socket->recover){
 #ifdef DEBUGPRINTS
                 printf("\nFrom fast recovery to congestion avoidance\n");
 #endif
                 socket->comgestion_state = congestion_avoidance;
-                socket->cwnd = socket->ssthresh;
-                tripleACKCounter = 0;
+                sample.exit_recovery = 1;
+            }else if(socket->inflight_count > 0){
+                //partial ACK, the next hole is the new oldest segment
+                if(sack_retransmit(socket) == -1){
+                    return -1;
+                }
             }
+        }
 
-            socket->ack_number++;
-
-            if(retransmission_flag == 1){
-                //We retransmitt all the chunks from the last good ack we receive
-                size_t k = 0;
-                for(k = i ; k < chunks; k++){
-
-#ifdef DEBUGPRINTS
-                    printf("\nWe start retransmission from chunk %zu\n",k);
-#endif
-
-                    retransmission_flag = 0;
-
+        sample.in_flight = socket->seq_number - socket->snd_una;
+        rate_sample(socket, &rs, &sample);
+        socket->cc->on_ack(socket, &sample);
+    }else if(ack == socket->snd_una && socket->inflight_count > 0){
+        socket->dup_acks++;
+        sample.in_flight = socket->seq_number - socket->snd_una;
+        rate_sample(socket, &rs, &sample);
+        //Triple Ack Handler
+        if(socket->dup_acks == 3) {
 #ifdef DEBUGPRINTS
-                    printf("Sending %zu chunk\n",i);
+            printf("%s got 3 duplicate ACKs for %zu, retransmitting it\n", socket->isServer ? "i am server" : "i am client", ack);
 #endif
-                    message.header.seq_number = socket->seq_number;
-                    message.header.ack_number = socket->ack_number;
-                    message.header.control = 0;
-                    message.header.window = 0;
-                    message.header.data_len = maxPayload ;
-                    message.header.future_use0 = 0;
-                    message.header.future_use1 = 0;
-                    message.header.future_use2 = 0;
-                    message.header.checksum = 0;
-                    memcpy(message.payload, buffer + k * maxPayload ,  message.header.data_len);
-                    message.header.checksum = crc32((const uint8_t *) &message, sizeof(message) + message.header.data_len);
-                    printf("\ncheckum = %u\n", message.header.checksum);
-                    extraPayload += sizeof(microtcp_header_t);
-
-                    if(sendto(socket->sd, &message, (sizeof(message.header) + message.header.data_len), 0, &(socket->peerAdress), socket->peerAdressLen)  == -1){
-                        perror("error in sentTo in send\n");
-                    }
-                    socket->packets_send++;
-                    socket->bytes_send += message.header.data_len;
-                    socket->seq_number += message.header.data_len;
 
+            if(socket->comgestion_state != fast_recovery){
 #ifdef DEBUGPRINTS
-                    for(size_t j = 0;j < message.header.data_len;j++) {
-                        printf("%c", ((char *) message.payload)[j]);
-                    }
-                    printf("\nChunk %zu sent\n",k);
+                printf("\nFrom slow start or congestion avoidance to fast recovery\n");
 #endif
-                }
+                socket->comgestion_state = fast_recovery;
+                socket->cc->on_loss(socket);
+                socket->recover = socket->seq_number;
+                socket->recovery_us = sample.now_us;
+            }
+            //only the segments the receiver is missing are resent
+            if(sack_retransmit(socket) == -1){
+                return -1;
+            }
+        }else{
+            socket->cc->on_ack(socket, &sample);
+            //more SACKs may have exposed more holes
+            if(socket->dup_acks > 3 && socket->comgestion_state == fast_recovery &&
+               socket->sack_blocks > 0 && sack_retransmit(socket) == -1){
+                return -1;
+            }
+        }
+    }
 
-                //Extra chunk
-                if( bytes_to_send % MICROTCP_MSS){
+    return 0;
+}
 
-#ifdef DEBUGPRINTS
-                    printf("\nextraPayload %lu\n", extraPayload);
+/*
+ * Fires the retransmission timer of the oldest in-flight segment if it has
+ * expired. Only that segment is resent, the rest may well have arrived.
+ *
+ * returns:
+ *      0 for success
+ *      -1 for failure
+ */
+static int
+check_retransmission_timer(microtcp_sock_t *socket)
+{
+    microtcp_segment_t *seg;
+    uint64_t now = now_us();
+
+    pmtu_probe_timer(socket, now);
+
+    if(socket->inflight_count == 0) return 0;
+
+    seg = inflight_at(socket, 0);
+    if(now < seg->sent_us + socket->rto_us) return 0;
+
+#ifdef DEBUGPRINTS
+    printf("Receive timeout occurred, resending seq# = %zu (rto %lu us)\n", seg->seq_number, (unsigned long) socket->rto_us);
 #endif
-                    message.header.seq_number = socket->seq_number;
-                    message.header.ack_number = socket->ack_number;
-                    message.header.data_len = extraChunkSize + extraPayload;
-                    message.header.checksum = 0;
-                    memcpy(message.payload, buffer + (k * maxPayload), message.header.data_len);
-                    message.header.checksum = crc32((const uint8_t *) &message, sizeof(message) + message.header.data_len);
+    rto_backoff(socket);
+    socket->rto_retries++;
+
+    //into a closed window the segment is a window probe, resent as the
+    //persist timer backs off but no sign of congestion
+    if(socket->peer_win_size == 0) return send_segment_batch(socket, 0, 1);
+
+    socket->packets_lost++;
+    socket->bytes_lost += seg->len;
+
+    socket->cc->on_timeout(socket);
+    socket->dup_acks = 0;
+    socket->rto_recovery = 1;
+    socket->recover = socket->seq_number;
+
+    //the same segment lost again and again, it may be too big for the path
+    if(seg->retransmits + 1 >= MICROTCP_PROBE_TRIES && seg->len + sizeof(microtcp_header_t) > MICROTCP_MSS){
+        pmtu_black_hole(socket);
+    }
+
+    if(send_segment_batch(socket, 0, 1) == -1){
+        return -1;
+    }
+
+    return 0;
+}
+
+//copies the len bytes of a datagram spread over the buffers of msg into buf
+static void
+iov_gather(const struct msghdr *msg, size_t len, uint8_t *buf)
+{
+    size_t n;
+    size_t i;
+
+    for(i = 0; i < msg->msg_iovlen && len > 0; i++){
+        n = msg->msg_iov[i].iov_len < len ? msg->msg_iov[i].iov_len : len;
+        memcpy(buf, msg->msg_iov[i].iov_base, n);
+        buf += n;
+        len -= n;
+    }
+}
+
+//copies a datagram of len bytes into the buffers of msg, cutting off what
+//does not fit like recvmsg() does, returns how much fit
+static size_t
+iov_scatter(const struct msghdr *msg, const uint8_t *buf, size_t len)
+{
+    size_t done = 0;
+    size_t n;
+    size_t i;
+
+    for(i = 0; i < msg->msg_iovlen && done < len; i++){
+        n = msg->msg_iov[i].iov_len < len - done ? msg->msg_iov[i].iov_len : len - done;
+        memcpy(msg->msg_iov[i].iov_base, buf + done, n);
+        done += n;
+    }
 
+    return done;
+}
+
+//the connection id a datagram of len bytes in msg carries, 0 for none or
+//if it is too short to carry one
+static uint32_t
+datagram_conn_id(const struct msghdr *msg, size_t len)
+{
+    microtcp_header_t header;
+
+    if(len < sizeof(header)) return 0;
+    iov_gather(msg, sizeof(header), (uint8_t *) &header);
+    return header.future_use2;
+}
+
+//bytes a datagram of len bytes takes in rxq, its length and itself, aligned
+static size_t
+rxq_record_len(size_t len)
+{
+    return 8 + ((len + 7) & ~(size_t) 7);
+}
+
+//size of the rxq of a socket, twice its receive buffer as the datagrams of
+//a whole window and their headers must fit, up to MICROTCP_RXQ_LEN
+static size_t
+rxq_len(const microtcp_sock_t *socket)
+{
+    return min(2 * socket->recvbuf_len, MICROTCP_RXQ_LEN, SIZE_MAX);
+}
+
+/*
+ * Queues a datagram another socket of the demux read for conn. A record never
+ * wraps around the end of the ring, if it does not fit there the end is
+ * skipped, marked with a length of UINT32_MAX.
+ *
+ * returns:
+ *      the datagram in the queue
+ *      NULL if the queue is full, the datagram is dropped as the kernel drops
+ *      one a full socket buffer cannot take
+ */
+static message_t *
+rxq_put(microtcp_sock_t *conn, const struct msghdr *msg, size_t len)
+{
+    size_t need = rxq_record_len(len);
+    size_t size = rxq_len(conn);
+    size_t pos = conn->rxq_tail & (size - 1);
+    size_t skip = size - pos < need ? size - pos : 0;
+    uint8_t *record;
+
+    if(conn->rxq_tail + skip + need - conn->rxq_head > size) return NULL;
+    if(conn->rxq == NULL && (conn->rxq = malloc(size)) == NULL) return NULL;
+
+    if(skip > 0){
+        *(uint32_t *) (conn->rxq + pos) = UINT32_MAX;
+        conn->rxq_tail += skip;
+        pos = 0;
+    }
+    record = conn->rxq + pos;
+    *(uint32_t *) record = len;
+    iov_gather(msg, len, record + 8);
+    conn->rxq_tail += need;
+
+    return (message_t *) (record + 8);
+}
+
+//moves the queued datagrams into msgs as recvmmsg() would, as many as the
+//receive batch takes, returns how many
+static int
+rxq_read(microtcp_sock_t *socket, struct mmsghdr *msgs)
+{
+    size_t n = 0;
+    size_t pos;
+    uint32_t len;
+
+    while(n < socket->rx_slots && socket->rxq_head != socket->rxq_tail){
+        pos = socket->rxq_head & (rxq_len(socket) - 1);
+        len = *(uint32_t *) (socket->rxq + pos);
+        if(len == UINT32_MAX){
+            socket->rxq_head += rxq_len(socket) - pos;
+            continue;
+        }
+        msgs[n].msg_len = iov_scatter(&msgs[n].msg_hdr, socket->rxq + pos + 8, len);
+        socket->rxq_head += rxq_record_len(len);
+        n++;
+    }
+
+    return n;
+}
+
+//takes a connection out of the ones of its demux still in their handshake
+static void
+handshake_leave(microtcp_sock_t *conn)
+{
+    microtcp_demux_t *demux = conn->demux;
+    size_t i;
+
+    for(i = 0; i < demux->handshake_count; i++){
+        if(demux->handshaking[i] == conn){
+            demux->handshaking[i] = demux->handshaking[--demux->handshake_count];
+            return;
+        }
+    }
+}
+
+//drops a connection of the demux the application never got
+static void
+conn_drop(microtcp_sock_t *conn)
+{
+    if(conn->state == SYN_RECEIVED) handshake_leave(conn);
+    conn->demux->pending--;
+    sock_release(conn);
+    free(conn);
+}
+
+//queues a connection whose handshake completed for microtcp_accept_connection(),
+//if the listening socket has been shut down meanwhile it is dropped
+static void
+accept_ready(microtcp_sock_t *conn)
+{
+    microtcp_demux_t *demux = conn->demux;
+
+    //the client has its id now, a SYN without one from the same address and
+    //port is a new connection of its
+    microtcp_demux_remove(demux, &conn->peerAdress, 0);
+    handshake_leave(conn);
+    if(demux->listener == NULL){
+        conn_drop(conn);
+        return;
+    }
+
+    demux->accepted[(demux->accept_head + demux->accept_count) % demux->backlog] = conn;
+    demux->accept_count++;
+}
+
+//refuses a client the backlog has no room for with a RST, its connect fails
+//at once instead of waiting for a SYN + ACK
+static void
+listen_refuse(microtcp_sock_t *socket, const struct sockaddr *address, socklen_t address_len,
+              const message_t *syn)
+{
+    microtcp_header_t header;
+
+    header.seq_number = 0;
+    header.ack_number = syn->header.seq_number + 1;
+    header.control = RST_FLAG | ACK_FLAG;
+    header.window = 0;
+    header.data_len = 0;
+    header.future_use0 = 0;
+    header.future_use1 = 0;
+    header.future_use2 = 0;
+    header.checksum = header_checksum(&header);
+
+    sendto(socket->sd, &header, sizeof(header), 0, address, address_len);
 #ifdef DEBUGPRINTS
-                    printf("Sending extra %zu chunk\n",i);
-                    for(size_t j = 0;j < message.header.data_len;j++) {
-                        printf("%c", ((char *) message.payload)[j]);
-                    }
+    printf("backlog full, sent RST to a new client\n");
 #endif
+}
+
+//a SYN from a peer without a connection: one is created for it, on the UDP
+//socket of the listening socket and with its congestion control, and
+//answers with its SYN + ACK
+static void
+listen_syn(microtcp_demux_t *demux, const struct sockaddr *address, socklen_t address_len,
+           const message_t *message)
+{
+    microtcp_sock_t *listener = demux->listener;
+    microtcp_sock_t *conn;
 
-                    if(sendto(socket->sd, &message, sizeof(message.header) + message.header.data_len, 0, &(socket->peerAdress), socket->peerAdressLen)  == -1){
-                        perror("error in sentTo in send\n");
-                    }
+    if(listener == NULL) return;
+    if(demux->pending >= demux->backlog){
+        listen_refuse(listener, address, address_len, message);
+        return;
+    }
 
-                    socket->packets_send++;
-                    socket->bytes_send += message.header.data_len;
-                    socket->seq_number += message.header.data_len;
+    conn = malloc(sizeof(*conn));
+    if(conn == NULL) return;
+    //a listening socket may hold many, each gets small buffers
+    if(sock_init(conn, MICROTCP_CONN_BUF_LEN, MICROTCP_CONN_BUF_LEN) == -1){
+        free(conn);
+        return;
+    }
+    conn->sd = listener->sd;
+    conn->isServer = 1;
+    conn->state = SYN_RECEIVED;
+    memcpy(&(conn->peerAdress), address, sizeof(struct sockaddr));
+    conn->peerAdressLen = address_len;
+    conn->conn_id = microtcp_demux_new_id(demux);
+    if(microtcp_demux_insert(demux, &conn->peerAdress, 0, conn) == -1 ||
+       microtcp_demux_insert(demux, &conn->peerAdress, conn->conn_id, conn) == -1){
+        microtcp_demux_remove(demux, &conn->peerAdress, 0);
+        sock_release(conn);
+        free(conn);
+        return;
+    }
+    conn->demux = demux;
+    demux->users++;
+    demux->pending++;
 
 #ifdef DEBUGPRINTS
-                    printf("\nChunk %zu sent\n",i);
+    printf("resived SYN with seq# = %d from a new peer\n", message->header.seq_number);
 #endif
-                }
+    if(microtcp_set_congestion_control(conn, listener->cc->name) == -1 || syn_received(conn, message) == -1){
+        conn_drop(conn);
+        return;
+    }
+
+    //its SYN + ACK is resent until the client answers, see handshake_timers()
+    demux->handshaking[demux->handshake_count++] = conn;
+    if(demux->handshake_us == 0 || conn->syn_sent_us + conn->rto_us < demux->handshake_us){
+        demux->handshake_us = conn->syn_sent_us + conn->rto_us;
+    }
+}
+
+/*
+ * The handshake timer of a listening socket: resends the SYN + ACK of each
+ * connection still in its handshake whose RTO ran out, backing the RTO off,
+ * and drops the ones still without an answer after MICROTCP_SYN_RETRIES
+ * resends. Any socket of the demux fires it from run_timers().
+ */
+static void
+handshake_timers(microtcp_demux_t *demux)
+{
+    uint64_t now = now_us();
+    microtcp_sock_t *conn;
+    size_t i = 0;
 
+    demux->handshake_us = 0;
+    while(i < demux->handshake_count){
+        conn = demux->handshaking[i];
+        if(now >= conn->syn_sent_us + conn->rto_us){
+            if(conn->syn_retries >= MICROTCP_SYN_RETRIES){
+#ifdef DEBUGPRINTS
+                printf("no answer to the SYN + ACK, dropping the connection\n");
+#endif
+                //the last of them moves into slot i
+                conn_drop(conn);
+                continue;
             }
+            conn->syn_retries++;
+            rto_backoff(conn);
+            send_syn_ack(conn);
         }
+        if(demux->handshake_us == 0 || conn->syn_sent_us + conn->rto_us < demux->handshake_us){
+            demux->handshake_us = conn->syn_sent_us + conn->rto_us;
+        }
+        i++;
+    }
+}
 
-        remaining -= bytes_to_send;
-        data_sent += bytes_to_send;
+/*
+ * Hands a datagram that a socket of the demux read to where it belongs: the
+ * queue of the connection of its peer and conn_id, or a new connection if it
+ * is a SYN from a peer we do not know. Anything else from an unknown peer is dropped.
+ * A connection still in its handshake only keeps the segment completing it,
+ * and only if it carries data, the connection then waits to be accepted.
+ */
+static void
+demux_dispatch(microtcp_demux_t *demux, const struct msghdr *msg, size_t len, uint32_t conn_id)
+{
+    microtcp_sock_t *conn = microtcp_demux_lookup(demux, msg->msg_name, conn_id);
+    message_t syn;
+    message_t *message;
+    size_t tail;
+
+    if(conn == NULL){
+        //only a SYN comes without an id, one with an id we do not know is
+        //for a connection that is gone
+        if(conn_id != 0 || len > sizeof(syn)) return;
+        iov_gather(msg, len, (uint8_t *) &syn);
+        if(check_received_segment(&syn, len) == 0 && (syn.header.control & (SYN_FLAG | ACK_FLAG)) == SYN_FLAG){
+            listen_syn(demux, msg->msg_name, msg->msg_namelen, &syn);
+        }
+        return;
     }
 
+    tail = conn->rxq_tail;
+    message = rxq_put(conn, msg, len);
+    if(message == NULL || conn->state != SYN_RECEIVED) return;
+
+    if(check_received_segment(message, len) == 0){
+        if((message->header.control & (SYN_FLAG | ACK_FLAG)) == SYN_FLAG){
+            //our SYN + ACK got lost, the client asks again
+            send_syn_ack(conn);
+        }else if(accept_complete(conn, message) == 0){
+            if(message->header.control != 0) conn->rxq_tail = tail;
+            accept_ready(conn);
+            return;
+        }
+    }
+    conn->rxq_tail = tail;
+}
 
-    message.header.seq_number = socket->seq_number;
-    message.header.ack_number = socket->ack_number;
-    message.header.control = FIN_FLAG;
-    message.header.window = 0;
-    message.header.data_len = 0;
-    message.header.future_use0 = 0;
-    message.header.future_use1 = 0;
-    message.header.future_use2 = 0;
-    message.header.checksum = 0;
-    message.header.checksum = crc32((const uint8_t *) &message, sizeof(message) + message.header.data_len);
+//reads a batch of datagrams into msgs, rx_slots of them, waiting up to
+//wait_us (0 never blocks) for the first one only, returns how many came or
+//-1 with errno set. In a demux the ones for another connection are handed to
+//it and left here as empty datagrams
+static int
+read_batch(microtcp_sock_t *socket, struct mmsghdr *msgs, uint64_t wait_us)
+{
+    struct sockaddr_storage from[MICROTCP_RECV_BATCH];
+    uint32_t conn_id;
+    int queued = 0;
+    int ret;
+    size_t j;
+
+    //the datagrams another socket of the demux read for this one come
+    //first, they are older than anything still in the kernel
+    if(socket->rxq_head != socket->rxq_tail) queued = rxq_read(socket, msgs);
+    ret = queued;
+
+    if(queued == 0){
+        for(j = 0; socket->demux != NULL && j < socket->rx_slots; j++){
+            msgs[j].msg_hdr.msg_name = &from[j];
+            msgs[j].msg_hdr.msg_namelen = sizeof(from[j]);
+        }
 
-    if (sendto(socket->sd, &message, sizeof(message), 0, &(socket->peerAdress), socket->peerAdressLen) == -1) {
-        return -1;
+        //what is already queued needs no wait, only an empty socket is polled
+        //until the first datagram or the deadline of the caller
+        ret = recvmmsg(socket->sd, msgs, socket->rx_slots, MSG_DONTWAIT, NULL);
+        if(ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) && wait_us != 0){
+            if(wait_readable(socket, wait_us) == -1) return -1;
+            ret = recvmmsg(socket->sd, msgs, socket->rx_slots, MSG_DONTWAIT, NULL);
+        }
+        if(ret <= 0){
+            if(ret == 0) errno = EAGAIN;
+            return -1;
+        }
     }
-    socket->packets_send++;
-    socket->bytes_send++;
+
+    for(j = 0; j < (size_t) ret; j++){
+        socket->rx_len[j] = msgs[j].msg_len;
+        if(queued || socket->demux == NULL) continue;
+
+        conn_id = datagram_conn_id(&msgs[j].msg_hdr, msgs[j].msg_len);
+        if(socket->state == LISTEN || !microtcp_demux_match(socket, (struct sockaddr *) &from[j], conn_id)){
+            demux_dispatch(socket->demux, &msgs[j].msg_hdr, msgs[j].msg_len, conn_id);
+            socket->rx_len[j] = 0;
+        }
+    }
+    socket->rx_count = ret;
+    socket->rx_next = 0;
+
+    return ret;
+}
+
+/*
+ * Hands out the next received datagram, reading a whole batch of them into
+ * segbuf with one recvmmsg once the last batch is used up. Only the first
+ * datagram of a batch is waited for, up to wait_us (0 never blocks), the
+ * rest are the ones already queued. A datagram stays valid until the batch
+ * after its own is read.
+ *
+ * returns:
+ *      its length, with *message pointing to it
+ *      -1 for failure or a timeout, with errno set
+ */
+static ssize_t
+next_datagram(microtcp_sock_t *socket, message_t **message, uint64_t wait_us)
+{
+    struct mmsghdr msgs[MICROTCP_RECV_BATCH];
+    struct iovec iov[MICROTCP_RECV_BATCH];
+    size_t len = segbuf_len(socket);
+    size_t j;
+
+    if(socket->rx_next == socket->rx_count){
+        for(j = 0; j < socket->rx_slots; j++){
+            iov[j].iov_base = socket->segbuf + j * len;
+            iov[j].iov_len = len;
+
+            memset(&msgs[j], 0, sizeof(msgs[j]));
+            msgs[j].msg_hdr.msg_iov = &iov[j];
+            msgs[j].msg_hdr.msg_iovlen = 1;
+        }
+
+        if(read_batch(socket, msgs, wait_us) == -1) return -1;
+    }
+
+    *message = (message_t *) (socket->segbuf + socket->rx_next * len);
+    return socket->rx_len[socket->rx_next++];
+}
+
+
+/*
+ * Waits for the next segment of the close handshake: one carrying all the
+ * given flags and acknowledging everything we have sent. Data the peer still
+ * sends, what it queued before it answers our FIN, is taken in and ACKed so
+ * it can drain, then thrown away as nobody reads it any more. Anything else,
+ * like late ACKs for data or duplicates, is skipped. Every time the wait times
+ * out resend (if not NULL) is sent again and the RTO backed off, giving up
+ * after MICROTCP_CLOSE_RETRIES with errno ETIMEDOUT.
+ *
+ * returns:
+ *      0 for success
+ *      -1 for failure
+ */
+static int
+wait_close_segment(microtcp_sock_t *socket, message_t *message, uint16_t flags, const message_t *resend)
+{
+    message_t *segment;
+    ssize_t received;
+    int retries = 0;
+
+    while(retries <= MICROTCP_CLOSE_RETRIES){
+        //the data taken in below gets one ACK once its batch is used up
+        if(socket->ack_pending > 0 && socket->rx_next == socket->rx_count && sentACK(socket) == -1) return -1;
+
+        received = next_datagram(socket, &segment, socket->rto_us);
+        if(received < 0){
+            if(errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR) return -1;
+            retries++;
+            rto_backoff(socket);
+            if(resend != NULL &&
+               sendto(socket->sd, resend, message_len(resend), 0, &(socket->peerAdress), socket->peerAdressLen) == -1){
+                return -1;
+            }
+            continue;
+        }
+
+        if(check_received_segment(segment, received)) continue;
+        if(segment->header.control == 0){
+            if(recv_segment(socket, segment, received, NULL, 0) == -1) return -1;
+            socket->buf_read_pos += socket->buf_fill_level;
+            socket->curr_win_size += socket->buf_fill_level;
+            socket->buf_fill_level = 0;
+            continue;
+        }
+        if((segment->header.control & flags) != flags) continue;
+        if(segment->header.ack_number != (uint32_t) socket->seq_number) continue;
+
+        memcpy(message, segment, (size_t) received < sizeof(*message) ? (size_t) received : sizeof(*message));
+        return 0;
+    }
+
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+/*
+ * Stays around after the last ACK of the close handshake, like TIME_WAIT: if
+ * that ACK gets lost the peer resends its FIN + ACK, which is answered with
+ * ack again. It lasts 2 RTOs, but not less than 2 MICROTCP_ACK_TIMEOUT_US as
+ * the RTO of the peer may be backed off further than ours, and starts over
+ * with every FIN.
+ */
+static void
+close_linger(microtcp_sock_t *socket, const message_t *ack)
+{
+    uint64_t linger_us = 2 * (socket->rto_us > MICROTCP_ACK_TIMEOUT_US ? socket->rto_us : MICROTCP_ACK_TIMEOUT_US);
+    uint64_t until = now_us() + linger_us;
+    uint64_t now;
+    message_t *segment;
+    ssize_t received;
+
+    while((now = now_us()) < until){
+        received = next_datagram(socket, &segment, until - now);
+        if(received < 0){
+            if(errno == EINTR) continue;
+            return;
+        }
+
+        if(check_received_segment(segment, received)) continue;
+        if(!(segment->header.control & FIN_FLAG)) continue;
+
 #ifdef DEBUGPRINTS
-    printf("sent FIN with seq# = %d, ack# =  %d\n\n", message.header.seq_number, message.header.ack_number);
+        printf("FIN + ACK again, resending the last ACK\n\n");
 #endif
-    socket->seq_number++;
-    printf("sented the fin\n");
+        if(sendto(socket->sd, ack, message_len(ack), 0, &(socket->peerAdress), socket->peerAdressLen) == -1){
+            return;
+        }
+        until = now_us() + linger_us;
+    }
+}
+
+//caps a wait at the first deadline of the socket's timers: the retransmission
+//timer of the oldest segment, the time a paced sender may send its next one,
+//the delayed ACK, the persist timer and, on a socket of a listening socket,
+//the handshake timer. Every wait is a poll up to that deadline, run_timers()
+//then fires what is due
+static uint64_t
+timer_wait(microtcp_sock_t *socket, uint64_t wait_us)
+{
+    uint64_t expires = UINT64_MAX;
+    uint64_t now;
+
+    if(wait_us == 0) return 0;
+
+    now = now_us();
+    if(socket->inflight_count > 0){
+        expires = inflight_at(socket, 0)->sent_us + socket->rto_us;
+    }
+    if(socket->sndbuf_nxt != socket->sndbuf_end && socket->pacing_next_us > now &&
+       socket->pacing_next_us < expires && socket->cc->pacing_rate(socket) != 0){
+        expires = socket->pacing_next_us;
+    }
+    if(socket->ack_due_us != 0 && socket->ack_due_us < expires){
+        expires = socket->ack_due_us;
+    }
+    if(socket->persist_us != 0 && socket->persist_us < expires){
+        expires = socket->persist_us;
+    }
+    if(socket->demux != NULL && socket->demux->handshake_us != 0 && socket->demux->handshake_us < expires){
+        expires = socket->demux->handshake_us;
+    }
+
+    if(expires == UINT64_MAX) return wait_us;
+    if(expires <= now) return 0;
+    return expires - now < wait_us ? expires - now : wait_us;
+}
+
+//fires the timers that are due: the handshakes of the demux, retransmission
+//(a window probe while the peer's window is closed), delayed ACK, then sends
+//what pacing or the persist timer lets out
+static int
+run_timers(microtcp_sock_t *socket)
+{
+    microtcp_demux_t *demux = socket->demux;
+
+    if(demux != NULL && demux->handshake_us != 0 && now_us() >= demux->handshake_us){
+        handshake_timers(demux);
+    }
+    //a listening socket has nothing of its own to send
+    if(socket->state == LISTEN) return 0;
+
+    if(check_retransmission_timer(socket) == -1) return -1;
+    if(ack_flush(socket) == -1) return -1;
+
+    return transmit_new(socket);
+}
+
+/*
+ * One round of the sender, independent of any microtcp_send() call: sends
+ * what the windows allow, waits up to wait_us (but never past the timer of
+ * the oldest segment) for ACKs, processes every ACK that is already there
+ * and fires the retransmission timer. wait_us == 0 never blocks.
+ *
+ * returns:
+ *      0 for success
+ *      -1 for failure
+ */
+static int
+send_pump(microtcp_sock_t *socket, uint64_t wait_us)
+{
+    message_t *ackMesege;
+    ssize_t bytesReceived;
+
+    if(transmit_new(socket) == -1) return -1;
+
+    wait_us = timer_wait(socket, wait_us);
+
+    //the first read may block, the rest only drain what is already queued
+    while((bytesReceived = next_datagram(socket, &ackMesege, wait_us)) >= 0){
+        wait_us = 0;
+
+        //ignore anything that is not a valid ACK, a resent SYN + ACK too as
+        //the data we send completes the handshake of the server
+        if (check_received_segment(ackMesege, bytesReceived)) continue;
+        if ((ackMesege->header.control & (ACK_FLAG | SYN_FLAG)) != (ACK_FLAG)) continue;
+
+        if(process_ack(socket, ackMesege) == -1) return -1;
+    }
+    if(errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR){
+        //recfrom fail
+        return -1;
+    }
+
+    return run_timers(socket);
+}
+
+//a peer that has let MICROTCP_SEND_RETRIES retransmission timeouts in a row
+//go unanswered is taken for gone, a blocked send gives up with ETIMEDOUT
+static int
+send_timed_out(microtcp_sock_t *socket)
+{
+    if(socket->rto_retries < MICROTCP_SEND_RETRIES) return 0;
+
+    errno = ETIMEDOUT;
+    return 1;
+}
+
+//blocks until every byte queued by microtcp_send() has been acknowledged
+static int
+send_flush(microtcp_sock_t *socket)
+{
+    while(socket->inflight_count > 0 || socket->sndbuf_nxt != socket->sndbuf_end){
+        if(send_timed_out(socket) || send_pump(socket, socket->rto_us) == -1){
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Allocates the send buffer and the in-flight ring with the first send, a
+ * socket that only receives never needs them. A connection of a listening
+ * socket takes no more send buffer than the window its peer advertises,
+ * between MICROTCP_CONN_BUF_MIN and sndbuf_len, and the ring has a slot
+ * for every segment of the smallest MSS that buffer holds, up to
+ * MICROTCP_INFLIGHT_LEN.
+ *
+ * returns:
+ *      0 for success
+ *      -1 for failure
+ */
+static int
+send_buffers(microtcp_sock_t *socket)
+{
+    size_t len = socket->sndbuf_len;
+    size_t slots = 1;
+
+    if(socket->demux != NULL){
+        while(len > MICROTCP_CONN_BUF_MIN && len / 2 >= socket->peer_win_size) len /= 2;
+    }
+    while(slots < MICROTCP_INFLIGHT_LEN && slots * MICROTCP_MIN_MSS < len) slots *= 2;
+
+    socket->sndbuf = malloc(len);
+    if(socket->sndbuf == NULL) return -1;
+    socket->inflight = malloc(slots * sizeof(microtcp_segment_t));
+    if(socket->inflight == NULL){
+        free(socket->sndbuf);
+        socket->sndbuf = NULL;
+        return -1;
+    }
+    socket->sndbuf_len = len;
+    socket->inflight_len = slots;
+
+    return 0;
+}
+
+//microtcp_send() with the socket to itself
+static ssize_t
+sock_send(microtcp_sock_t *socket, const void *buffer, size_t length)
+{
+    size_t copied = 0;
+    size_t space;
+    size_t idx;
+    size_t n;
+
+    if(socket->sndbuf == NULL && send_buffers(socket) == -1){
+        return -1;
+    }
+
+    //copy everything into the send buffer, only wait when it is full
+    while(copied < length){
+        space = socket->sndbuf_len - (socket->sndbuf_end - socket->sndbuf_una);
+        if(space == 0){
+            if(send_timed_out(socket) || send_pump(socket, socket->rto_us) == -1){
+                return -1;
+            }
+            continue;
+        }
+
+        idx = socket->sndbuf_end & (socket->sndbuf_len - 1);
+        n = min(space, length - copied, socket->sndbuf_len - idx);
+        memcpy(socket->sndbuf + idx, (const uint8_t *) buffer + copied, n);
+        socket->sndbuf_end += n;
+        copied += n;
+    }
+
+    //put on the wire whatever the windows allow and return without waiting
+    if(send_pump(socket, 0) == -1){
+        return -1;
+    }
+
+    return copied;
+}
+
+ssize_t
+microtcp_send (microtcp_sock_t *socket, const void *buffer, size_t length,
+               int flags)
+{
+    ssize_t ret;
 
+    engine_enter(socket);
+    ret = sock_send(socket, buffer, length);
+    engine_leave(socket);
 
-    return data_sent;
+    return ret;
+}
+
+//sets (or clears) the bits of rcv_map for the bytes [from, to)
+static void
+map_fill(microtcp_sock_t *socket, size_t from, size_t to, int set)
+{
+    uint64_t *word;
+    uint64_t mask;
+    size_t bit;
+    size_t n;
+
+    while(from < to){
+        bit = from & 63;
+        n = 64 - bit < to - from ? 64 - bit : to - from;
+        mask = (n == 64 ? ~(uint64_t) 0 : ((uint64_t) 1 << n) - 1) << bit;
+        word = &socket->rcv_map[(from & (socket->recvbuf_len - 1)) >> 6];
+        if(set) *word |= mask;
+        else *word &= ~mask;
+        from += n;
+    }
+}
+
+//returns the first byte in [from, to) whose bit is set (or clear), to if
+//there is none, a whole word of the other kind is skipped at once
+static size_t
+map_next(const microtcp_sock_t *socket, size_t from, size_t to, int set)
+{
+    uint64_t word;
+    size_t bit;
+
+    while(from < to){
+        bit = from & 63;
+        word = socket->rcv_map[(from & (socket->recvbuf_len - 1)) >> 6];
+        if(!set) word = ~word;
+        word >>= bit;
+        if(word != 0){
+            from += __builtin_ctzll(word);
+            return from < to ? from : to;
+        }
+        from += 64 - bit;
+    }
+
+    return to;
+}
+
+//returns where the run of held bytes that ends at seq starts, not below floor
+static size_t
+map_run_start(const microtcp_sock_t *socket, size_t seq, size_t floor)
+{
+    uint64_t word;
+    size_t bit;
+
+    while(seq > floor){
+        bit = (seq - 1) & 63;
+        word = ~socket->rcv_map[((seq - 1) & (socket->recvbuf_len - 1)) >> 6];
+        word <<= 63 - bit;
+        if(word != 0){
+            seq -= __builtin_clzll(word);
+            return seq > floor ? seq : floor;
+        }
+        seq -= bit + 1;
+    }
+
+    return floor;
+}
+
+//copies len bytes of the stream that start at seq into the receive ring
+static void
+ring_put(microtcp_sock_t *socket, size_t seq, const uint8_t *data, size_t len)
+{
+    size_t pos = seq & (socket->recvbuf_len - 1);
+    size_t first = socket->recvbuf_len - pos < len ? socket->recvbuf_len - pos : len;
+
+    memcpy(socket->recvbuf + pos, data, first);
+    memcpy(socket->recvbuf, data + first, len - first);
+}
+
+//hands the caller up to length of the in-order data waiting in the ring,
+//returns how much
+static size_t
+ring_read(microtcp_sock_t *socket, uint8_t *buffer, size_t length)
+{
+    size_t pos = socket->buf_read_pos & (socket->recvbuf_len - 1);
+    size_t len = socket->buf_fill_level < length ? socket->buf_fill_level : length;
+    size_t first = socket->recvbuf_len - pos < len ? socket->recvbuf_len - pos : len;
+
+    memcpy(buffer, socket->recvbuf + pos, first);
+    memcpy(buffer + first, socket->recvbuf, len - first);
+    socket->buf_read_pos += len;
+    socket->buf_fill_level -= len;
+    socket->curr_win_size += len;
+
+    return len;
+}
+
+//moves the ack# up to seq, then on over the bytes held past the hole it
+//closed, returns how many bytes joined the in-order stream
+static size_t
+recv_advance(microtcp_sock_t *socket, size_t seq)
+{
+    size_t start = socket->ack_number;
+    size_t end;
+
+    if(socket->ooo_high > start){
+        map_fill(socket, start, seq, 0);
+        while(seq < socket->ooo_high && map_next(socket, seq, seq + 1, 1) == seq){
+            end = map_next(socket, seq, socket->ooo_high, 0);
+            map_fill(socket, seq, end, 0);
+            seq = end;
+        }
+    }
+    if(socket->ooo_high < seq) socket->ooo_high = seq;
+
+    socket->ack_number = seq;
+    socket->curr_win_size -= seq - start;
+    socket->bytes_received += seq - start;
+
+    return seq - start;
+}
+
+/*
+ * Takes in the payload of a data segment that starts at seq. What is already
+ * in order is dropped and so is what does not fit in the ring. If nothing is
+ * waiting to be read, the in-order part goes straight to buffer (up to length
+ * bytes), the rest is kept in the ring until microtcp_recv() reads it or the
+ * hole before it is filled.
+ *
+ * returns:
+ *      the bytes it put in buffer, 0 for a segment past a hole or a duplicate
+ */
+static size_t
+recv_store(microtcp_sock_t *socket, size_t seq, const uint8_t *payload, size_t len,
+           uint8_t *buffer, size_t length, int *in_order)
+{
+    size_t end = seq + len;
+    size_t fit = 0;
+
+    *in_order = 0;
+    if(end > socket->buf_read_pos + socket->recvbuf_len) end = socket->buf_read_pos + socket->recvbuf_len;
+    if(seq < socket->ack_number){
+        payload += socket->ack_number - seq;
+        seq = socket->ack_number;
+    }
+    if(seq >= end) return 0;
+
+    if(seq > socket->ack_number){
+        ring_put(socket, seq, payload, end - seq);
+        map_fill(socket, seq, end, 1);
+        if(end > socket->ooo_high) socket->ooo_high = end;
+        socket->ooo_last = seq;
+        return 0;
+    }
+
+    *in_order = 1;
+    if(socket->buf_fill_level == 0){
+        fit = end - seq < length ? end - seq : length;
+        memcpy(buffer, payload, fit);
+        socket->buf_read_pos += fit;
+        socket->curr_win_size += fit;
+    }
+    ring_put(socket, seq + fit, payload + fit, end - seq - fit);
+    socket->buf_fill_level += recv_advance(socket, end) - fit;
+
+    return fit;
+}
+
+//writes the ranges held past the hole as SACK blocks, the one with the most
+//recent segment first and then the lowest, returns their length in bytes
+static uint32_t
+put_sack_blocks(microtcp_sock_t *socket, uint8_t *payload)
+{
+    size_t first = socket->ooo_high;
+    size_t left;
+    size_t right;
+    uint32_t edge[2];
+    uint32_t len = 0;
+    int blocks = 0;
+
+    if(socket->ooo_last > socket->ack_number && socket->ooo_last < socket->ooo_high &&
+       map_next(socket, socket->ooo_last, socket->ooo_last + 1, 1) == socket->ooo_last){
+        first = map_run_start(socket, socket->ooo_last, socket->ack_number);
+        edge[0] = first;
+        edge[1] = map_next(socket, socket->ooo_last, socket->ooo_high, 0);
+        memcpy(payload, edge, sizeof(edge));
+        len += sizeof(edge);
+        blocks++;
+    }
+
+    right = socket->ack_number;
+    while(blocks < socket->sack_blocks){
+        left = map_next(socket, right, socket->ooo_high, 1);
+        if(left == socket->ooo_high) break;
+        right = map_next(socket, left, socket->ooo_high, 0);
+        if(left == first) continue;
+        edge[0] = left;
+        edge[1] = right;
+        memcpy(payload + len, edge, sizeof(edge));
+        len += sizeof(edge);
+        blocks++;
+    }
+
+    return len;
 }
 
 int sentACK(microtcp_sock_t *socket){
@@ -890,148 +3008,531 @@ int sentACK(microtcp_sock_t *socket){
     //sending duplicate ack
     message.header.seq_number = socket->seq_number;
     message.header.ack_number = socket->ack_number;
-    message.header.window = socket->curr_win_size;
+    message.header.window = window_field(socket);
     message.header.control = ACK_FLAG;
-    message.header.window = 0;
     message.header.data_len = 0;
-    message.header.future_use0 = 0;
-    message.header.future_use1 = 0;
-    message.header.future_use2 = 0;
+    stamp_header(socket, &message.header);
+    message.header.future_use2 = socket->conn_id;
+    //tell the sender which segments past the hole we already hold
+    if(socket->sack_blocks > 0 && socket->ooo_high > socket->ack_number){
+        message.header.data_len = put_sack_blocks(socket, message.payload);
+        if(message.header.data_len > 0) message.header.control |= SACK_FLAG;
+    }
     message.header.checksum = 0;
-    message.header.checksum = crc32((const uint8_t *) &message, sizeof(message) + message.header.data_len);
+    //without SACK blocks the payload was never written, only the header counts
+    message.header.checksum = message.header.data_len > 0 ?
+                              segment_checksum(&message.header, message.payload, message.header.data_len) :
+                              header_checksum(&message.header);
 
-    if (sendto(socket->sd, &message, sizeof(message), 0, &(socket->peerAdress), socket->peerAdressLen) == -1) {
+    if (sendto(socket->sd, &message, sizeof(message.header) + message.header.data_len, 0,
+               &(socket->peerAdress), socket->peerAdressLen) == -1) {
         return -1;
     }
+    socket->ack_pending = 0;
+    socket->ack_due_us = 0;
     socket->packets_send++;
     socket->bytes_send++;
 #ifdef DEBUGPRINTS
     printf("sent ACK with seq# = %d, ack# =  %d\n\n", message.header.seq_number, message.header.ack_number);
 #endif
-    socket->seq_number++;
 
     return 0;
 }
 
+//sends the ACK the receiver owes, once MICROTCP_DELACK_SEGS segments are in
+//or the delayed ACK timer of a single one is due
+static int
+ack_flush(microtcp_sock_t *socket)
+{
+    if(socket->ack_pending == 0) return 0;
+    if(socket->ack_pending < MICROTCP_DELACK_SEGS && now_us() < socket->ack_due_us) return 0;
 
-ssize_t
-microtcp_recv (microtcp_sock_t *socket, void *buffer, size_t length, int flags)
+    return sentACK(socket);
+}
+
+//counts an in-order segment toward the next ACK, one that fills a hole (held)
+//is ACKed at once, the rest wait for MICROTCP_DELACK_SEGS more or the end of
+//the batch they came in
+static int
+ack_segment(microtcp_sock_t *socket, int held)
 {
-    message_t message;
-    int ack = 0;
-    size_t remainingSizeOfBuff = socket->init_win_size;
+    socket->ack_pending++;
+    if(held || socket->ack_pending >= MICROTCP_DELACK_MAX) return sentACK(socket);
+    if(socket->ack_due_us == 0) socket->ack_due_us = now_us() + MICROTCP_DELACK_US;
 
+    return 0;
+}
 
-    struct sockaddr resaddress;
-    socklen_t resaddressLen;
-    ssize_t ToatalDataReseved = 0;
-    size_t fillLevelOfBuffer = 0;
-    size_t remaining_leng_of_buff = length;
+//answers a path MTU probe with the size that arrived
+static int
+probe_reply(microtcp_sock_t *socket, uint32_t size)
+{
+    message_t message;
 
-    //reset the flow window
-    socket->curr_win_size = remainingSizeOfBuff;
+    message.header.seq_number = socket->seq_number;
+    message.header.ack_number = socket->ack_number;
+    message.header.window = window_field(socket);
+    message.header.control = ACK_FLAG | PROBE_FLAG;
+    message.header.data_len = sizeof(size);
+    memcpy(message.payload, &size, sizeof(size));
+    stamp_header(socket, &message.header);
+    message.header.future_use2 = socket->conn_id;
+    message.header.checksum = 0;
+    message.header.checksum = segment_checksum(&message.header, message.payload, message.header.data_len);
 
-    while(remainingSizeOfBuff > 0 ){
+    if (sendto(socket->sd, &message, sizeof(message.header) + message.header.data_len, 0,
+               &(socket->peerAdress), socket->peerAdressLen) == -1) {
+        return -1;
+    }
 
-        //if we dont receive data it means that the server is done sending data so we return
-        struct timeval timeout;
-        timeout. tv_sec = 0;
-        timeout. tv_usec = MICROTCP_ACK_TIMEOUT_US;
-        if ( setsockopt( socket->sd , SOL_SOCKET, SO_RCVTIMEO , & timeout , sizeof( struct timeval)) < 0) {
-            perror(" error in setsockopt\n");
+    return 0;
+}
+
+/*
+ * Reads a batch like next_datagram() does, but the payload of its first
+ * datagrams lands straight in buffer, rcv_seg bytes apart, as the in-order
+ * segments they most likely are. Their header goes to their slot of segbuf
+ * and whatever payload does not fit right after it. The in-order ones at the
+ * front are taken in where they landed, closing up the gap a short one
+ * leaves. The first one that is anything else, and every one after it, is
+ * moved whole into its slot, to be handed out by next_datagram().
+ *
+ * returns:
+ *      the bytes it put in buffer, 0 if it took in none
+ *      -1 for failure or a timeout, with errno set
+ */
+static ssize_t
+recv_direct(microtcp_sock_t *socket, uint8_t *buffer, size_t length, uint64_t wait_us)
+{
+    struct mmsghdr msgs[MICROTCP_RECV_BATCH];
+    struct iovec iov[MICROTCP_RECV_BATCH][3];
+    size_t len = segbuf_len(socket);
+    size_t seg = socket->rcv_seg;
+    size_t direct = length / seg;
+    size_t delivered = 0;
+    size_t pl;
+    size_t fit;
+    size_t j;
+    message_t *message;
+    uint32_t crc;
+    int in_order = 1;
+
+    if(direct == 0) direct = 1;
+    if(direct > socket->rx_slots) direct = socket->rx_slots;
+
+    for(j = 0; j < socket->rx_slots; j++){
+        memset(&msgs[j], 0, sizeof(msgs[j]));
+        msgs[j].msg_hdr.msg_iov = iov[j];
+        if(j < direct){
+            iov[j][0].iov_base = socket->segbuf + j * len;
+            iov[j][0].iov_len = sizeof(microtcp_header_t);
+            iov[j][1].iov_base = buffer + j * seg;
+            iov[j][1].iov_len = length - j * seg < seg ? length - j * seg : seg;
+            iov[j][2].iov_base = socket->segbuf + j * len + sizeof(microtcp_header_t);
+            iov[j][2].iov_len = len - sizeof(microtcp_header_t);
+            msgs[j].msg_hdr.msg_iovlen = 3;
+        }else{
+            iov[j][0].iov_base = socket->segbuf + j * len;
+            iov[j][0].iov_len = len;
+            msgs[j].msg_hdr.msg_iovlen = 1;
         }
+    }
 
-        //we resive data
-        if (recvfrom(socket->sd, socket->recvbuf, socket->curr_win_size, 0, &resaddress, &resaddressLen) < 0) {
-            printf("No more data to resive right know\n");
-            return 0;
+    if(read_batch(socket, msgs, wait_us) == -1) return -1;
+
+    for(j = 0; j < direct && j < socket->rx_count; j++){
+        message = (message_t *) (socket->segbuf + j * len);
+        //one that its slot cannot hold whole is dropped
+        if(socket->rx_len[j] > len) socket->rx_len[j] = 0;
+        pl = socket->rx_len[j] > sizeof(message->header) ? socket->rx_len[j] - sizeof(message->header) : 0;
+        fit = pl < iov[j][1].iov_len ? pl : iov[j][1].iov_len;
+
+        if(in_order && pl > 0 && message->header.control == 0 && message->header.data_len == pl &&
+           seq_expand(socket->ack_number, message->header.seq_number) == socket->ack_number &&
+           socket->ooo_high == socket->ack_number &&
+           !(socket->ts_ok && (int32_t) (message->header.future_use0 - socket->ts_recent) < 0)){
+            crc = update_crc32(checksum_header(&message->header), iov[j][1].iov_base, fit);
+            crc = update_crc32(crc, message->payload, pl - fit) ^ 0xffffffff;
+            if(crc == message->header.checksum){
+                if(buffer + delivered != iov[j][1].iov_base) memmove(buffer + delivered, iov[j][1].iov_base, fit);
+                if(socket->ts_ok) socket->ts_recent = message->header.future_use0;
+                socket->packets_received++;
+                if(pl > socket->rcv_seg) socket->rcv_seg = pl;
+
+                //what did not fit in buffer waits in the ring
+                socket->buf_read_pos += fit;
+                socket->curr_win_size += fit;
+                ring_put(socket, socket->ack_number + fit, message->payload, pl - fit);
+                socket->buf_fill_level += recv_advance(socket, socket->ack_number + pl) - fit;
+                delivered += fit;
+                socket->rx_next = j + 1;
+                if(ack_segment(socket, 0) == -1) return -1;
+
+                //the ones after it come after what waits in the ring
+                if(pl > fit) in_order = 0;
+                continue;
+            }
         }
 
-        memcpy(&message.header, socket->recvbuf, sizeof(message.header));
-        memcpy(&message.payload, socket->recvbuf + sizeof(message.header), message.header.data_len);
+        in_order = 0;
+        memmove(message->payload + fit, message->payload, pl - fit);
+        memcpy(message->payload, iov[j][1].iov_base, fit);
+    }
 
+    return delivered;
+}
 
-        printf("\ncheckum = %u\n", message.header.checksum);
-        //check that we revived the message correctly
-//        if (check_resived_checksum(message) == -1){
-//                //send duplicate ack
-//            printf("\n\nFAIL 1  sending duplicate ACK\n\n");
-//                if(sentACK(socket) == -1)return 0;
-//            }
+/*
+ * Handles one received segment: ACKs for what we sent, a path MTU probe, the
+ * peer's FIN, which moves the socket to CLOSING_BY_PEER, or data, whose
+ * in-order part goes straight to buffer (up to length bytes) if nothing is
+ * waiting in the ring, the rest into the ring.
+ *
+ * returns:
+ *      the bytes it put in buffer
+ *      -1 for failure
+ */
+static ssize_t
+recv_segment(microtcp_sock_t *socket, const message_t *message, ssize_t received,
+             uint8_t *buffer, size_t length)
+{
+    size_t fit;
+    size_t seq;
+    int in_order;
+    int held;
 
-//        //check the seq
-//        if (message.header.ack_number != socket->seq_number) {
-//            printf(" i am %s AND header ack: %u != soket seq: %zu ", socket->isServer ? "i am server" : "i am client", message.header.ack_number, socket->seq_number);
-//            return -1;
-//        }
-//
-//        if (message.header.seq_number != socket->ack_number) {
-//            printf("i am %s AND header seq: %u != soket ack: %zu ", socket->isServer ? "i am server" : "i am client", message.header.ack_number, socket->seq_number);
-//            printf("sent duplicate ACK");
-//            if(sentACK(socket) == -1)return -1;
-//        }
-
-        //check if client wants to close the connection
-        if ((message.header.control & FIN_FLAG | ACK_FLAG) == (FIN_FLAG | ACK_FLAG) && socket->isServer) {
-            //save the seq# we got from the client
-            socket->packets_received++;
-            socket->ack_number++; //= message.header.seq_number;
+    if (received < (ssize_t) sizeof(message->header)) return 0;
+    if (message->header.data_len > received - sizeof(message->header)) return 0;
 
-            //change the socket state
-            socket->state = CLOSING_BY_PEER;
+    //check that we revived the message correctly, if not ask for it again
+    if (check_segment_checksum(message) == -1){
+#ifdef DEBUGPRINTS
+        printf("bad checksum, sending duplicate ACK\n");
+#endif
+        return sentACK(socket) == -1 ? -1 : 0;
+    }
 
+    //check if the peer wants to close the connection. Its FIN takes the seq#
+    //right after all of its data: one that overtook data still missing, or a
+    //duplicate, only gets a duplicate ACK
+    if ((message->header.control & (FIN_FLAG | ACK_FLAG)) == (FIN_FLAG | ACK_FLAG)) {
+        if (seq_expand(socket->ack_number, message->header.seq_number) != socket->ack_number ||
+            socket->ooo_high > socket->ack_number) {
 #ifdef DEBUGPRINTS
-            printf("resiveed FIN + ACK with seq# = %d, ack# = %d\n\n", message.header.seq_number,
-                   message.header.ack_number);
+            printf("FIN with seq# = %u while expecting %zu, sending duplicate ACK\n", message->header.seq_number, socket->ack_number);
 #endif
-            printf("returning correctly\n");
-            return 0;
+            return sentACK(socket) == -1 ? -1 : 0;
         }
 
-        //check if server is done sending data
-        if ((message.header.control & FIN_FLAG) == FIN_FLAG) {
-            socket->ack_number++;
-            return 0;
-        }
+        //save the seq# we got from the peer
+        socket->packets_received++;
+        socket->ack_number++; //= message->header.seq_number;
 
-        //save the seq# we got from the client
-        socket->ack_number += message.header.data_len + 1;
+        //change the socket state
+        socket->state = CLOSING_BY_PEER;
 
+#ifdef DEBUGPRINTS
+        printf("resiveed FIN + ACK with seq# = %d, ack# = %d\n\n", message->header.seq_number,
+               message->header.ack_number);
+#endif
+        return 0;
+    }
 
-        //pass the data to the user
-        if(message.header.data_len <= remaining_leng_of_buff){
-            memcpy(buffer + fillLevelOfBuffer, message.payload, message.header.data_len);
-            //adjust the total data
-            ToatalDataReseved += message.header.data_len;
-            remaining_leng_of_buff -= message.header.data_len;
-            //if the if was unsuccessful the wille will fail
-            remainingSizeOfBuff -= message.header.data_len;
-            socket->curr_win_size = remainingSizeOfBuff;
+    //the server resends its SYN + ACK, the ACK that ended our handshake got lost
+    if ((message->header.control & (SYN_FLAG | ACK_FLAG)) == (SYN_FLAG | ACK_FLAG)) {
+        return sentACK(socket) == -1 ? -1 : 0;
+    }
+
+    //a path MTU probe is answered with its size, the answer to one of
+    //ours only moves our MSS
+    if (message->header.control & PROBE_FLAG) {
+        if (message->header.control & ACK_FLAG) {
+            if(process_ack(socket, message) == -1)return -1;
+        }else if(probe_reply(socket, received) == -1){
+            return -1;
+        }
+        return 0;
+    }
 
+    //ACKs for data we sent keep our own sender going
+    if ((message->header.control & (ACK_FLAG | FIN_FLAG | SYN_FLAG)) == ACK_FLAG &&
+        (message->header.data_len == 0 || (message->header.control & SACK_FLAG))) {
+        if(process_ack(socket, message) == -1)return -1;
+        if(check_retransmission_timer(socket) == -1)return -1;
+        if(transmit_new(socket) == -1)return -1;
+        return 0;
+    }
+
+    seq = seq_expand(socket->ack_number, message->header.seq_number);
+
+    //PAWS: a segment stamped before the last one we accepted is an old
+    //duplicate, even if its wrapped seq# happens to look right
+    if (socket->ts_ok && (int32_t) (message->header.future_use0 - socket->ts_recent) < 0) {
 #ifdef DEBUGPRINTS
-            printf("resived: ");
-            for (size_t i = 0; i < message.header.data_len; i++) {
-                printf("%c", (message.payload)[i]);
-            }
+        printf("old TSval %u (recent %u), sending duplicate ACK\n", message->header.future_use0, socket->ts_recent);
+#endif
+        return sentACK(socket) == -1 ? -1 : 0;
+    }
 
-            printf("\nsenting ACK\n");
+    if (socket->ts_ok && seq <= socket->ack_number) socket->ts_recent = message->header.future_use0;
+
+    //a segment past a hole is held in the ring until the hole is filled,
+    //the duplicate ACK tells the sender what is missing
+    held = socket->ooo_high > socket->ack_number;
+    fit = recv_store(socket, seq, message->payload, message->header.data_len, buffer, length, &in_order);
+    if (!in_order) {
+#ifdef DEBUGPRINTS
+        printf("out of order seq# = %u while expecting %zu, sending duplicate ACK\n", message->header.seq_number, socket->ack_number);
 #endif
-        }else{
-            remainingSizeOfBuff = 0;
-            socket->curr_win_size = 0;
+        return sentACK(socket) == -1 ? -1 : 0;
+    }
+
+    socket->packets_received++;
+
+    //pass the data to the user, along with the held data it joins up
+    //with, what does not fit waits in the ring for the next call
+    fit += ring_read(socket, buffer + fit, length - fit);
 
+    if (message->header.data_len > socket->rcv_seg) socket->rcv_seg = message->header.data_len;
+    if(ack_segment(socket, held) == -1)return -1;
 
-            //sentACK(socket);
-            //sent headers with win = 0
+    return fit;
+}
+
+//microtcp_recv() with the socket to itself
+static ssize_t
+sock_recv(microtcp_sock_t *socket, void *buffer, size_t length, int flags)
+{
+    message_t *message;
+    int small_window = socket->curr_win_size == 0 || socket->curr_win_size < socket->rcv_seg;
+
+
+    ssize_t received;
+    size_t ToatalDataReseved = 0;
+    size_t remaining_leng_of_buff = length;
+    uint64_t wait_us;
+
+    //what is already in order in the ring goes first
+    ToatalDataReseved = ring_read(socket, buffer, length);
+    remaining_leng_of_buff -= ToatalDataReseved;
+
+    //the peer has closed its side, there is nothing more to read
+    if(socket->state == CLOSING_BY_PEER) return ToatalDataReseved;
+
+    //a peer we stopped with a window too small for a segment is told right
+    //away once it may send one again. With an engine thread the ring holds
+    //everything that came between two calls, so this is most of the ACKs
+    //that open the window
+    if(small_window && socket->curr_win_size > 0 && socket->curr_win_size >= socket->rcv_seg){
+        if(sentACK(socket) == -1)return -1;
+    }
+
+    while(remaining_leng_of_buff > 0){
+
+        //we resive data, blocking only until the first bytes arrive, after
+        //that we take just what is already there like a stream socket does
+        wait_us = ToatalDataReseved > 0 || (flags & MSG_DONTWAIT) ? 0 : timer_wait(socket, MICROTCP_WAIT_FOREVER);
+        received = 0;
+
+        //with nothing queued, nothing waiting to be read and no hole, the next
+        //segments are most likely in order and go straight to the user
+        if (socket->rx_next == socket->rx_count && socket->buf_fill_level == 0 &&
+            socket->ooo_high == socket->ack_number && socket->rcv_seg > 0) {
+            received = recv_direct(socket, (uint8_t *) buffer + ToatalDataReseved, remaining_leng_of_buff, wait_us);
+            if (received > 0) {
+                received += ring_read(socket, (uint8_t *) buffer + ToatalDataReseved + received,
+                                      remaining_leng_of_buff - received);
+                ToatalDataReseved += received;
+                remaining_leng_of_buff -= received;
+                continue;
+            }
         }
+        if (received == 0) received = next_datagram(socket, &message, wait_us);
+        if (received < 0) {
+            if (errno != EWOULDBLOCK && errno != EAGAIN && errno != EINTR) return -1;
+            //the batch is over, one ACK covers it
+            if(ack_flush(socket) == -1)return -1;
+            if (ToatalDataReseved > 0) return ToatalDataReseved;
+
+            //nothing yet, only our own timers are due
+            if(run_timers(socket) == -1)return -1;
+            if (flags & MSG_DONTWAIT) {
+                errno = EAGAIN;
+                return -1;
+            }
+            continue;
+        }
+
+        received = recv_segment(socket, message, received, (uint8_t *) buffer + ToatalDataReseved,
+                                remaining_leng_of_buff);
+        if (received == -1) return -1;
+
+        //adjust the total data
+        ToatalDataReseved += received;
+        remaining_leng_of_buff -= received;
 
-        //sent ACK
-        printf("Sending  %d ack to server\n", ack);
-        sentACK(socket);
-        ack++;
+        //the client closed the connection, what it sent before is all there is
+        if (socket->state == CLOSING_BY_PEER) return ToatalDataReseved;
     }
 
+    if(ack_flush(socket) == -1)return -1;
+
     return ToatalDataReseved;
 
 }
 
+ssize_t
+microtcp_recv (microtcp_sock_t *socket, void *buffer, size_t length, int flags)
+{
+    ssize_t ret;
+
+    engine_enter(socket);
+    ret = sock_recv(socket, buffer, length, flags);
+    engine_leave(socket);
+
+    return ret;
+}
+
+/*
+ * The protocol engine thread of a socket and the application take turns
+ * with the lock, whoever holds it runs the protocol. The thread sleeps
+ * until a datagram or its next timer, the application kicks it through
+ * wake when it leaves a call, since the deadlines the thread slept with may
+ * have moved meanwhile.
+ */
+struct microtcp_engine
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int wake;           //eventfd
+    int sleeping;       //the thread is waiting with deadlines of its own
+    int stop;
+};
+
+static void
+engine_enter(microtcp_sock_t *socket)
+{
+    if(socket->engine != NULL) pthread_mutex_lock(&socket->engine->lock);
+}
+
+static void
+engine_leave(microtcp_sock_t *socket)
+{
+    struct microtcp_engine *engine = socket->engine;
+
+    if(engine == NULL) return;
+    if(engine->sleeping){
+        engine->sleeping = 0;
+        eventfd_write(engine->wake, 1);
+    }
+    pthread_mutex_unlock(&engine->lock);
+}
+
+//the engine thread: everything that came in while the application was away
+//is processed, the timers run, and it sleeps until there is more. Once the
+//peer has closed its side the rest is the close handshake, which is left to
+//microtcp_shutdown(). A failure is left for the next call of the
+//application to run into
+static void *
+engine_run(void *arg)
+{
+    microtcp_sock_t *socket = arg;
+    struct microtcp_engine *engine = socket->engine;
+    struct pollfd pfd[2];
+    struct timespec timeout;
+    message_t *message;
+    ssize_t received;
+    eventfd_t kicks;
+    uint64_t wait_us;
+    int open;
+
+    pfd[0].fd = engine->wake;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = socket->sd;
+    pfd[1].events = POLLIN;
+
+    pthread_mutex_lock(&engine->lock);
+    while(!engine->stop){
+        open = socket->state == ESTABLISHED;
+        wait_us = MICROTCP_WAIT_FOREVER;
+        if(open){
+            while((received = next_datagram(socket, &message, 0)) >= 0){
+                if(recv_segment(socket, message, received, NULL, 0) == -1) break;
+                if(socket->state != ESTABLISHED) break;
+            }
+            ack_flush(socket);
+            run_timers(socket);
+            wait_us = timer_wait(socket, MICROTCP_WAIT_FOREVER);
+        }
+
+        timeout.tv_sec = wait_us / 1000000;
+        timeout.tv_nsec = (wait_us % 1000000) * 1000;
+        engine->sleeping = 1;
+        pthread_mutex_unlock(&engine->lock);
+
+        ppoll(pfd, open ? 2 : 1, wait_us == MICROTCP_WAIT_FOREVER ? NULL : &timeout, NULL);
+        if(pfd[0].revents & POLLIN) eventfd_read(engine->wake, &kicks);
+
+        pthread_mutex_lock(&engine->lock);
+        engine->sleeping = 0;
+    }
+    pthread_mutex_unlock(&engine->lock);
+
+    return NULL;
+}
+
+int
+microtcp_engine_start (microtcp_sock_t *socket)
+{
+    struct microtcp_engine *engine;
+
+    //a connection of a listening socket shares its UDP socket with the
+    //others, which are not the thread's to read for
+    if(socket->state != ESTABLISHED || socket->demux != NULL || socket->engine != NULL){
+        errno = EINVAL;
+        return -1;
+    }
+
+    engine = malloc(sizeof(*engine));
+    if(engine == NULL) return -1;
+    engine->wake = eventfd(0, EFD_NONBLOCK);
+    if(engine->wake == -1){
+        free(engine);
+        return -1;
+    }
+    pthread_mutex_init(&engine->lock, NULL);
+    engine->sleeping = 0;
+    engine->stop = 0;
+
+    socket->engine = engine;
+    if(pthread_create(&engine->thread, NULL, engine_run, socket) != 0){
+        socket->engine = NULL;
+        pthread_mutex_destroy(&engine->lock);
+        close(engine->wake);
+        free(engine);
+        return -1;
+    }
+
+    return 0;
+}
+
+//stops the engine thread of a socket, the application runs the protocol on
+//its own from then on
+static void
+engine_stop(microtcp_sock_t *socket)
+{
+    struct microtcp_engine *engine = socket->engine;
+
+    if(engine == NULL) return;
+
+    pthread_mutex_lock(&engine->lock);
+    engine->stop = 1;
+    eventfd_write(engine->wake, 1);
+    pthread_mutex_unlock(&engine->lock);
+    pthread_join(engine->thread, NULL);
+
+    socket->engine = NULL;
+    pthread_mutex_destroy(&engine->lock);
+    close(engine->wake);
+    free(engine);
+}
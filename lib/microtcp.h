@@ -36,23 +36,103 @@
 #define DEBUGPRINTS
 
 // Define control flags
+#define PROBE_FLAG (0b1 << 10)          /**< path MTU probe of padding, in an ACK the payload is the size that arrived */
+#define SACK_FLAG (0b1 << 11)           /**< ACK whose payload holds SACK blocks */
 #define ACK_FLAG (0b1 << 12)
 #define RST_FLAG (0b1 << 13)
 #define SYN_FLAG (0b1 << 14)
 #define FIN_FLAG (0b1 << 15)
 
+// Options carried in the payload of a SYN or SYN + ACK as kind, length
+// (of the whole option), value
+#define MICROTCP_OPT_END 0              /**< end of the option list */
+#define MICROTCP_OPT_TIMESTAMP 1        /**< TSval in future_use0, TSecr in future_use1 */
+#define MICROTCP_OPT_SACK 2             /**< SACK permitted, the value is the max blocks per ACK */
+#define MICROTCP_OPT_WSCALE 3           /**< window scale, the value is the shift of the sender's window field */
+#define MICROTCP_OPT_MSS 4              /**< largest segment the sender takes, header included, 16-bit value */
+
 /*
  * Several useful constants
  */
-#define MICROTCP_ACK_TIMEOUT_US 200000
-#define MICROTCP_MSS 1400
-#define MICROTCP_RECVBUF_LEN 8192
+#define MICROTCP_ACK_TIMEOUT_US 200000  /**< initial RTO, until the first RTT sample */
+#define MICROTCP_MIN_RTO_US 5000        /**< lower clamp of the RTO */
+#define MICROTCP_MAX_RTO_US 60000000    /**< upper clamp of the RTO, also bounds the backoff */
+#define MICROTCP_MSS 1400               /**< segment size, header included, with a peer that offers none */
+#define MICROTCP_MSS_PAYLOAD (MICROTCP_MSS - sizeof(microtcp_header_t)) /**< data a MICROTCP_MSS segment carries */
+#define MICROTCP_MIN_MSS 536            /**< smallest segment size we agree to */
+#define MICROTCP_MAX_MSS 65507          /**< largest segment size, the most a UDP datagram carries */
+#define MICROTCP_RECVBUF_LEN (4 * 1024 * 1024) /**< receive ring size, power of 2 */
 #define MICROTCP_WIN_SIZE MICROTCP_RECVBUF_LEN
-#define MICROTCP_INIT_CWND (3 * MICROTCP_MSS)
+#define MICROTCP_INIT_CWND(mss) (3 * (mss))
 #define MICROTCP_INIT_SSTHRESH MICROTCP_WIN_SIZE
+#define MICROTCP_SEND_BATCH 64          /**< max datagrams per sendmmsg call */
+#define MICROTCP_RECV_BATCH 64          /**< max datagrams per recvmmsg call */
+#define MICROTCP_RECV_BATCH_BYTES (1024 * 1024) /**< most the receive batch takes, large segments get fewer slots */
+#define MICROTCP_INFLIGHT_LEN 4096      /**< in-flight segment ring slots, power of 2 */
+#define MICROTCP_SNDBUF_LEN (4 * 1024 * 1024) /**< send buffer size, power of 2 */
+#define MICROTCP_MAX_WSCALE 14          /**< largest window shift, windows up to 1 GB */
+#define MICROTCP_WAIT_FOREVER UINT64_MAX
+#define MICROTCP_CLOSE_RETRIES 8        /**< resends of a FIN before giving up */
+#define MICROTCP_SYN_RETRIES 5          /**< resends of a SYN or SYN + ACK before giving up */
+#define MICROTCP_SEND_RETRIES 15        /**< retransmission timeouts in a row without an ACK before a send gives up */
+#define MICROTCP_SACK_BLOCKS 4          /**< max SACK blocks in one ACK */
+#define MICROTCP_DELACK_SEGS 2          /**< in-order segments the receiver takes in before it owes an ACK */
+#define MICROTCP_DELACK_MAX 16          /**< most segments one coalesced ACK waits for, even in the middle of a batch */
+#define MICROTCP_DELACK_US 2000         /**< longest a single segment waits for its ACK, below MICROTCP_MIN_RTO_US */
+#define MICROTCP_CC_DEFAULT "reno"      /**< congestion control of a new socket */
+#define MICROTCP_CC_MAX 8               /**< congestion control modules that can be registered */
+#define MICROTCP_CC_PRIV_LEN 32         /**< 64-bit words of private state per socket for the module */
+#define MICROTCP_PACING_BURST 2         /**< segments a paced sender may send back to back */
+#define MICROTCP_PROBE_TRIES 3          /**< lost path MTU probes of one size before giving up on it */
+#define MICROTCP_PROBE_STEP 64          /**< the path MTU search stops this close to its top */
+#define MICROTCP_PROBE_RAISE_US 600000000ULL /**< a finished path MTU search starts over after this long */
+#define MICROTCP_RXQ_LEN (1024 * 1024)  /**< datagrams of a connection queued while another one of its listening socket reads, power of 2 */
+#define MICROTCP_CONN_BUF_LEN (256 * 1024) /**< receive ring and largest send buffer of a connection of a listening socket, power of 2 */
+#define MICROTCP_CONN_BUF_MIN (64 * 1024) /**< smallest send buffer of such a connection, whatever window its peer offers, power of 2 */
+#define MICROTCP_DEMUX_SLOTS 128        /**< initial slots of the connection table of a listening socket, power of 2 */
+#define MICROTCP_SHARDS_MAX 255         /**< most listening sockets of microtcp_listen_shards(), a connection id names its own in a byte */
 
 enum cwd_states{slow_start, congestion_avoidance, fast_recovery};
 
+struct microtcp_sock;
+struct microtcp_demux;
+struct microtcp_engine;
+
+/**
+ * What the sender learned from one ACK, handed to the congestion control.
+ */
+typedef struct
+{
+  size_t acked;                 /**< Bytes newly acknowledged, 0 for a duplicate ACK */
+  uint64_t rtt_us;              /**< RTT measured on this ACK, 0 if none */
+  size_t in_flight;             /**< Bytes still unacknowledged after it */
+  int exit_recovery;            /**< This ACK ended fast recovery */
+  uint64_t now_us;              /**< When it was processed, modules keep time only by this */
+  uint64_t delivered;           /**< Bytes delivered so far, SACKed ones included */
+  uint64_t prior_delivered;     /**< delivered when the newest segment this ACK delivered was sent */
+  uint64_t delivery_rate;       /**< Bytes per second over that segment's flight, 0 if none */
+  int app_limited;              /**< The rate was limited by the application, not the path */
+} microtcp_ack_sample_t;
+
+/**
+ * A congestion control module. Every socket points to one, chosen by name
+ * with microtcp_set_congestion_control(). The module owns cwnd, ssthresh and
+ * moving comgestion_state between slow_start and congestion_avoidance; the
+ * sender only enters fast_recovery on a triple duplicate ACK and leaves it
+ * for congestion_avoidance when the recovery is over. Module state that does
+ * not fit those fields goes in cc_priv of the socket.
+ */
+typedef struct
+{
+  const char *name;             /**< The name it is registered and selected by */
+  void (*init)(struct microtcp_sock *socket);   /**< Sets the initial window */
+  void (*on_ack)(struct microtcp_sock *socket, const microtcp_ack_sample_t *sample); /**< Every ACK, duplicates included */
+  void (*on_loss)(struct microtcp_sock *socket);        /**< A triple duplicate ACK started fast recovery */
+  void (*on_timeout)(struct microtcp_sock *socket);     /**< The retransmission timer fired */
+  uint64_t (*pacing_rate)(struct microtcp_sock *socket); /**< Bytes per second to pace at, 0 sends whole windows */
+  size_t (*get_cwnd)(struct microtcp_sock *socket);     /**< The congestion window in bytes */
+} microtcp_cc_ops_t;
+
 /**
  * Possible states of the microTCP socket
  *
@@ -62,6 +142,7 @@ enum cwd_states{slow_start, congestion_avoidance, fast_recovery};
 typedef enum
 {
   LISTEN,
+  SYN_RECEIVED,
   ESTABLISHED,
   CLOSING_BY_PEER,
   CLOSING_BY_HOST,
@@ -70,13 +151,32 @@ typedef enum
 } mircotcp_state_t;
 
 
+/**
+ * Descriptor of a segment that has been sent but not yet acknowledged.
+ * The payload is not copied, it stays in the send buffer until it is acked.
+ */
+typedef struct
+{
+  size_t seq_number;            /**< seq# of the first payload byte */
+  const uint8_t *payload;       /**< Start of the payload */
+  uint32_t len;                 /**< Payload length in bytes */
+  uint32_t retransmits;         /**< How many times it has been resent */
+  uint32_t payload_crc;         /**< CRC-32 of the payload alone, joined to the header per send */
+  uint64_t sent_us;             /**< Time of the last (re)transmission, 0 if not sent yet */
+  int sacked;                   /**< The peer reported it in a SACK block */
+  uint64_t tx_delivered;        /**< Bytes delivered when it was last sent */
+  uint64_t tx_delivered_us;     /**< Time of that last delivery */
+  uint64_t tx_first_sent_us;    /**< Send time of the segment that delivery was sampled on */
+  int tx_app_limited;           /**< It was sent while the application was the bottleneck */
+} microtcp_segment_t;
+
 /**
  * This is the microTCP socket structure. It holds all the necessary
  * information of each microTCP socket.
  *
  * NOTE: Fill free to insert additional fields.
  */
-typedef struct
+typedef struct microtcp_sock
 {
   int sd;                       /**< The underline UDP socket descriptor */
   mircotcp_state_t state;       /**< The state of the microTCP socket */
@@ -89,21 +189,93 @@ typedef struct
   uint8_t *recvbuf;             /**< The *receive* buffer of the TCP
                                      connection. It is allocated during the connection establishment and
                                      is freed at the shutdown of the connection. This buffer is used
-                                     to retrieve the data from the network. */
-  size_t buf_fill_level;        /**< Amount of data in the buffer */
+                                     to retrieve the data from the network. It is a ring indexed by seq#,
+                                     holding the data not read yet and the segments that arrived past a hole */
+  size_t buf_fill_level;        /**< Amount of in-order data in the buffer not read yet */
+  size_t buf_read_pos;          /**< seq# of the first byte not read yet, where that data starts */
+  size_t recvbuf_len;           /**< Size of the receive buffer, power of 2, the most we advertise */
 
   enum cwd_states comgestion_state;
   size_t cwnd;
   size_t ssthresh;
+  const microtcp_cc_ops_t *cc;  /**< The congestion control module */
+  uint64_t cc_priv[MICROTCP_CC_PRIV_LEN]; /**< Private state of the module */
 
   size_t seq_number;            /**< Keep the state of the sequence number */
   size_t ack_number;            /**< Keep the state of the ack number */
+
+  microtcp_segment_t *inflight; /**< Ring of the sent but unacknowledged segments, NULL until the first send */
+  size_t inflight_len;          /**< Slots of the ring, power of 2 */
+  size_t inflight_head;         /**< Ring index of the oldest in-flight segment */
+  size_t inflight_count;        /**< Number of in-flight segments */
+  size_t snd_una;               /**< Oldest unacknowledged seq# */
+  size_t recover;               /**< seq# sent so far when fast recovery or the last timeout started */
+  int rto_recovery;             /**< Resending what was in flight when the retransmission timer fired */
+  int dup_acks;                 /**< Duplicate ACKs in a row */
+  size_t peer_win_size;         /**< The window last advertised by the peer, in bytes */
+  int snd_wscale;               /**< Shift of the peer's window field, 0 if it did not offer scaling */
+  int rcv_wscale;               /**< Shift of our window field, 0 if the peer did not offer scaling */
+
+  uint64_t srtt_us;             /**< Smoothed RTT, 0 until the first sample */
+  uint64_t rttvar_us;           /**< RTT variation */
+  uint64_t rto_us;              /**< Current retransmission timeout, backed off on every timeout */
+  int rto_retries;              /**< Retransmission timeouts in a row the peer has not answered */
+  int ts_ok;                    /**< Both sides agreed on the timestamp option */
+  int sack_blocks;              /**< SACK blocks each ACK may carry, 0 if SACK is off */
+  uint64_t recovery_us;         /**< When the current fast recovery started */
+
+  uint64_t delivered;           /**< Bytes delivered to the peer, cumulatively or SACKed */
+  uint64_t delivered_us;        /**< When delivered last grew */
+  uint64_t first_sent_us;       /**< Send time of the newest segment delivered so far */
+  uint64_t app_limited;         /**< delivered value at which the application stops being the bottleneck, 0 if it is not */
+  uint64_t pacing_next_us;      /**< Earliest time a paced sender may send its next segment */
+  uint64_t persist_us;          /**< When to probe the peer's closed window, 0 if the persist timer is off */
+
+  size_t mss;                   /**< Segment size the sender uses, header included, raised by path MTU probing */
+  size_t max_mss;               /**< Largest segment agreed at the 3-way handshake, the receive buffers are sized for it */
+  size_t probe_size;            /**< Size of the path MTU probe in flight, 0 if none */
+  size_t probe_high;            /**< Largest size the path MTU search may still try */
+  int probe_tries;              /**< Probes of the current size lost so far */
+  uint64_t probe_us;            /**< When the probe in flight was sent, or when to send the next one */
+  uint64_t probe_heard;         /**< packets_received when the probe in flight was sent */
+  uint8_t *segbuf;              /**< Receive batch, rx_slots segments each a message_t whose payload runs on to max_mss bytes */
+  size_t rx_slots;              /**< Segments the receive batch holds */
+  size_t rx_count;              /**< Datagrams the last recvmmsg read into it */
+  size_t rx_next;               /**< The next of them to be handed out */
+  size_t rx_len[MICROTCP_RECV_BATCH]; /**< Length of each of them */
+
+  uint64_t *rcv_map;            /**< One bit per byte of recvbuf, set for the bytes held past a hole */
+  size_t ooo_high;              /**< seq# right after the furthest byte held past a hole, ack_number if none */
+  size_t ooo_last;              /**< seq# of the last segment held past a hole, reported first */
+  size_t rcv_seg;               /**< Largest in-order payload received, where a direct receive expects the next ones */
+  uint32_t ts_recent;           /**< TSval of the last in-order segment, echoed as TSecr */
+  size_t ack_pending;           /**< In-order segments received since the last ACK we sent */
+  uint64_t ack_due_us;          /**< When the delayed ACK must go out, 0 if none is owed */
+
+  uint8_t *sndbuf;              /**< The *send* buffer, a ring microtcp_send() copies into.
+                                     Data stays in it until it is acknowledged. NULL until the first send */
+  size_t sndbuf_len;            /**< Size of the send buffer, power of 2, the most it may be before that */
+  size_t sndbuf_una;            /**< Stream offset of the oldest unacknowledged byte */
+  size_t sndbuf_nxt;            /**< Stream offset of the first byte not yet cut into a segment */
+  size_t sndbuf_end;            /**< Stream offset right after the last queued byte */
+
   uint64_t packets_send;
   uint64_t packets_received;
   uint64_t packets_lost;
   uint64_t bytes_send;
   uint64_t bytes_received;
   uint64_t bytes_lost;
+
+  struct microtcp_demux *demux; /**< What the connections of a listening socket share, NULL for a socket of its own */
+  uint8_t *rxq;                 /**< Ring of the datagrams for this connection another one of the demux read,
+                                     each a 32-bit length and the datagram, 8-byte aligned. NULL until the first */
+  size_t rxq_head;              /**< Offset of the oldest of them */
+  size_t rxq_tail;              /**< Offset right after the newest of them */
+  uint64_t syn_sent_us;         /**< When the SYN + ACK last went out, for the first RTT sample and its resends */
+  int syn_retries;              /**< Times the SYN + ACK has been resent for want of an answer */
+  uint32_t conn_id;             /**< Connection id the server picked in its SYN + ACK, carried in future_use2
+                                     of every segment after it. 0 for none */
+  struct microtcp_engine *engine; /**< The protocol engine thread of the socket, NULL if it has none */
 } microtcp_sock_t;
 
 
@@ -116,7 +288,7 @@ typedef struct
   uint32_t seq_number;          /**< Sequence number */
   uint32_t ack_number;          /**< ACK number */
   uint16_t control;             /**< Control bits (e.g. SYN, ACK, FIN) */
-  uint16_t window;              /**< Window size in bytes */
+  uint16_t window;              /**< Window size, in bytes shifted right by the negotiated window scale */
   uint32_t data_len;            /**< Data length in bytes (EXCLUDING header) */
   uint32_t future_use0;         /**< 32-bits for future use */
   uint32_t future_use1;         /**< 32-bits for future use */
@@ -127,12 +299,12 @@ typedef struct
 //a struct to packet the header and the payload
 typedef struct {
     microtcp_header_t header;
-    uint8_t payload[MICROTCP_MSS];
+    uint8_t payload[MICROTCP_MSS_PAYLOAD];
 }message_t;
 
 
 
-size_t min(size_t a, size_t b, size_t c) {
+static inline size_t min(size_t a, size_t b, size_t c) {
     size_t min_value = a;
 
     if (b < min_value) {
@@ -160,7 +332,8 @@ check_resived_checksum(message_t message);
 //      if == INVALID it failed
 //      for exact reason of failure check the .sd of the returned struct
 //          if == -1 fail in underline UDP sock inti
-//          if == -2 fail in malloc for the revbuff
+//          if == -2 fail in malloc for the revbuff, the in-flight ring, the send buffer,
+//                   the out-of-order map or the receive batch
 microtcp_sock_t
 microtcp_socket (int domain, int type, int protocol);
 
@@ -185,6 +358,73 @@ int
 microtcp_accept (microtcp_sock_t *socket, struct sockaddr *address,
                  socklen_t address_len);
 
+/**
+ * Turns a bound socket into a listening one that serves any number of
+ * clients on its port. Every datagram is handed to the connection of the
+ * peer that sent it, a SYN from a new peer starts a connection. Whichever of
+ * the listening socket and its connections waits reads for all of them, so
+ * they are used from one thread.
+ *
+ * @param socket a socket microtcp_bind() was called on, to an IPv4 address
+ * @param backlog most connections still in their handshake or waiting for
+ * microtcp_accept_connection(), further clients are refused
+ * @return 0 on success or -1 on failure, with errno EAFNOSUPPORT if the
+ * socket is not IPv4
+ */
+int
+microtcp_listen (microtcp_sock_t *socket, int backlog);
+
+/**
+ * Waits for a new connection on a listening socket.
+ *
+ * @param socket the listening socket
+ * @param address where to store the address of the peer, may be NULL
+ * @param address_len in: the size of address, out: the length of the
+ * peer's address
+ * @param flags MSG_DONTWAIT to only take a connection that is ready, so one
+ * thread can serve the listening socket and its connections in turn
+ * @return the new connection, or NULL on failure, with errno EAGAIN if
+ * MSG_DONTWAIT found none ready. It shares the UDP socket of the listening
+ * socket, its sd must not be closed. Once microtcp_shutdown() has closed it,
+ * it is released with free().
+ */
+microtcp_sock_t *
+microtcp_accept_connection (microtcp_sock_t *socket, struct sockaddr *address,
+                            socklen_t *address_len, int flags);
+
+/**
+ * Opens count listening sockets on the same address with SO_REUSEPORT. The
+ * kernel spreads the clients over them by a hash of their address, every
+ * datagram of a client reaches the same one. They share nothing, each has
+ * its own UDP socket, connection table and accept queue, so each can be
+ * served by a thread of its own and a connection is only ever processed by
+ * the thread of its socket.
+ *
+ * @param shards where to store the count listening sockets
+ * @param address the IPv4 address to bind them to
+ * @param backlog as for microtcp_listen(), of each of them
+ * @return 0 on success or -1 on failure, with none of them left open
+ */
+int
+microtcp_listen_shards (microtcp_sock_t *shards, size_t count,
+                        const struct sockaddr *address, socklen_t address_len,
+                        int backlog);
+
+/**
+ * Steers every datagram to the listening socket of microtcp_listen_shards()
+ * that owns its connection, by the connection id it carries rather than the
+ * hash of its address, with a classic BPF program attached to the
+ * SO_REUSEPORT group. The ones without an id yet, the SYN and its
+ * retransmissions, are still spread by the hash. It relies on the shards
+ * being the only sockets of the group, joined in their order, and lasts
+ * until one of them is shut down.
+ *
+ * @return 0 on success or -1 if the kernel cannot attach the program, the
+ * shards then go on steered by the hash
+ */
+int
+microtcp_steer_shards (microtcp_sock_t *shards, size_t count);
+
 int
 microtcp_shutdown(microtcp_sock_t *socket, int how);
 
@@ -192,8 +432,45 @@ ssize_t
 microtcp_send (microtcp_sock_t *socket, const void *buffer, size_t length,
                int flags);
 
+/**
+ * Starts a protocol engine thread for a connected socket that has a UDP
+ * socket of its own. Between the calls of the application it reads every
+ * segment, processes the ACKs, sends what microtcp_send() left in the send
+ * buffer as the windows open, takes in data for microtcp_recv() to read
+ * from the receive buffer and runs the timers, so a connection keeps moving
+ * while the application computes. The application and the thread take
+ * turns: a call of the application has the socket to itself until it
+ * returns. microtcp_shutdown() stops the thread.
+ *
+ * @return 0 on success or -1 on failure, the socket then goes on without one
+ */
+int
+microtcp_engine_start (microtcp_sock_t *socket);
+
+/**
+ * Receives data, waiting for the first bytes unless flags has MSG_DONTWAIT,
+ * then it returns -1 with errno EAGAIN if there are none yet. Returns 0 once
+ * the peer has closed its side.
+ */
 ssize_t
 microtcp_recv (microtcp_sock_t *socket, void *buffer, size_t length, int flags);
 
+/**
+ * Makes a congestion control module available to every socket by its name.
+ *
+ * @return 0 on success or -1 if the name is taken or the table is full
+ */
+int
+microtcp_register_congestion_control (const microtcp_cc_ops_t *ops);
+
+/**
+ * Switches the socket to the congestion control registered with name. The
+ * module starts over from its initial window.
+ *
+ * @return 0 on success or -1 if no module has that name
+ */
+int
+microtcp_set_congestion_control (microtcp_sock_t *socket, const char *name);
+
 
 #endif /* LIB_MICROTCP_H_ */
@@ -0,0 +1,71 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "microtcp_cc.h"
+
+//the registered modules, the built in ones first
+static const microtcp_cc_ops_t *cc_modules[MICROTCP_CC_MAX] = {
+    &microtcp_cc_reno,
+    &microtcp_cc_cubic,
+    &microtcp_cc_bbr,
+};
+
+const microtcp_cc_ops_t *
+microtcp_cc_find (const char *name)
+{
+    size_t i;
+
+    for(i = 0; i < MICROTCP_CC_MAX && cc_modules[i] != NULL; i++){
+        if(strcmp(cc_modules[i]->name, name) == 0) return cc_modules[i];
+    }
+
+    return NULL;
+}
+
+int
+microtcp_register_congestion_control (const microtcp_cc_ops_t *ops)
+{
+    size_t i;
+
+    if(ops == NULL || ops->name == NULL || microtcp_cc_find(ops->name) != NULL) return -1;
+
+    for(i = 0; i < MICROTCP_CC_MAX; i++){
+        if(cc_modules[i] == NULL){
+            cc_modules[i] = ops;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+int
+microtcp_set_congestion_control (microtcp_sock_t *socket, const char *name)
+{
+    const microtcp_cc_ops_t *ops = microtcp_cc_find(name);
+
+    if(ops == NULL) return -1;
+
+    socket->cc = ops;
+    memset(socket->cc_priv, 0, sizeof(socket->cc_priv));
+    socket->cc->init(socket);
+
+    return 0;
+}
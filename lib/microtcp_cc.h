@@ -0,0 +1,38 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIB_MICROTCP_CC_H_
+#define LIB_MICROTCP_CC_H_
+
+#include "microtcp.h"
+
+/*
+ * The congestion control modules built into the library, registered before
+ * the first lookup.
+ */
+extern const microtcp_cc_ops_t microtcp_cc_reno;
+extern const microtcp_cc_ops_t microtcp_cc_cubic;
+extern const microtcp_cc_ops_t microtcp_cc_bbr;
+
+//returns the module registered with name, or NULL if there is none
+const microtcp_cc_ops_t *
+microtcp_cc_find (const char *name);
+
+#endif /* LIB_MICROTCP_CC_H_ */
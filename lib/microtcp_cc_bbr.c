@@ -0,0 +1,292 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * BBR: instead of reacting to loss it builds a model of the path, the
+ * bottleneck bandwidth (windowed max of the delivery rate samples) and the
+ * round trip propagation time (windowed min RTT), and paces at the model's
+ * rate with a window of about one BDP, keeping the bottleneck queue short.
+ *
+ * STARTUP doubles the rate every round until the bandwidth stops growing,
+ * DRAIN empties the queue that built up, PROBE_BW cycles the pacing gain
+ * around 1 to look for more bandwidth and PROBE_RTT shrinks the window for a
+ * moment every 10 s to measure the RTT without our own queue in it.
+ */
+
+#include "microtcp_cc.h"
+
+#define BBR_HIGH_GAIN 2.885             /* 2/ln(2), doubles the delivery rate every round */
+#define BBR_BW_ROUNDS 10                /* rounds the max bandwidth filter spans */
+#define BBR_MIN_RTT_WIN_US 10000000     /* the min RTT is re-probed after this long */
+#define BBR_PROBE_RTT_US 200000         /* time spent at the minimum window in PROBE_RTT */
+#define BBR_MIN_CWND(mss) (4 * (mss))
+#define BBR_CYCLE_LEN 8
+
+static const double bbr_pacing_gain[BBR_CYCLE_LEN] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+
+enum bbr_mode {BBR_STARTUP, BBR_DRAIN, BBR_PROBE_BW, BBR_PROBE_RTT};
+
+typedef struct
+{
+  uint64_t bw[BBR_BW_ROUNDS];   /* max delivery rate of each of the last rounds, bytes/s */
+  uint64_t round_count;         /* round trips so far */
+  uint64_t next_round_delivered; /* delivered value that ends the current round */
+  uint64_t min_rtt_us;          /* min RTT seen in the last BBR_MIN_RTT_WIN_US */
+  uint64_t min_rtt_stamp_us;    /* when it was seen */
+  uint64_t probe_rtt_done_us;   /* end of the current PROBE_RTT, 0 if not started yet */
+  uint64_t cycle_stamp_us;      /* start of the current gain cycle phase */
+  uint64_t full_bw;             /* bandwidth STARTUP last grew to */
+  uint64_t prior_cwnd;          /* window before a recovery, a timeout or PROBE_RTT */
+  double pacing_gain;
+  double cwnd_gain;
+  int mode;
+  int cycle_idx;
+  int full_bw_count;            /* rounds without bandwidth growth */
+  int full_pipe;                /* STARTUP found the bottleneck */
+  int rto_recovery;             /* a timeout collapsed the window, prior_cwnd comes back when its recovery ends */
+} bbr_t;
+
+_Static_assert(sizeof(bbr_t) <= sizeof(((microtcp_sock_t *) 0)->cc_priv), "bbr_t must fit in cc_priv");
+
+static bbr_t *
+bbr(microtcp_sock_t *socket)
+{
+    return (bbr_t *) socket->cc_priv;
+}
+
+static uint64_t
+bbr_max_bw(const bbr_t *b)
+{
+    uint64_t bw = 0;
+    int i;
+
+    for(i = 0; i < BBR_BW_ROUNDS; i++){
+        if(b->bw[i] > bw) bw = b->bw[i];
+    }
+
+    return bw;
+}
+
+//gain times the estimated BDP, in bytes
+static size_t
+bbr_bdp(microtcp_sock_t *socket, double gain)
+{
+    bbr_t *b = bbr(socket);
+    uint64_t bw = bbr_max_bw(b);
+
+    if(bw == 0 || b->min_rtt_us == 0) return MICROTCP_INIT_CWND(socket->mss);
+    return (size_t) (gain * bw * b->min_rtt_us / 1e6);
+}
+
+static void
+bbr_set_mode(bbr_t *b, int mode, uint64_t now)
+{
+    b->mode = mode;
+    switch(mode){
+        case BBR_STARTUP:
+            b->pacing_gain = BBR_HIGH_GAIN;
+            b->cwnd_gain = BBR_HIGH_GAIN;
+            break;
+        case BBR_DRAIN:
+            b->pacing_gain = 1 / BBR_HIGH_GAIN;
+            b->cwnd_gain = BBR_HIGH_GAIN;
+            break;
+        case BBR_PROBE_BW:
+            //start anywhere in the cycle but in the draining phase
+            b->cycle_idx = now % (BBR_CYCLE_LEN - 1);
+            if(b->cycle_idx >= 1) b->cycle_idx++;
+            b->cycle_stamp_us = now;
+            b->pacing_gain = bbr_pacing_gain[b->cycle_idx];
+            b->cwnd_gain = 2;
+            break;
+        case BBR_PROBE_RTT:
+            b->pacing_gain = 1;
+            b->cwnd_gain = 1;
+            b->probe_rtt_done_us = 0;
+            break;
+    }
+}
+
+static void
+bbr_init(microtcp_sock_t *socket)
+{
+    bbr_t *b = bbr(socket);
+
+    socket->comgestion_state = slow_start;
+    socket->cwnd = MICROTCP_INIT_CWND(socket->mss);
+    socket->ssthresh = SIZE_MAX;
+    bbr_set_mode(b, BBR_STARTUP, 0);
+}
+
+//moves to the next phase of the gain cycle once the current one lasted a min RTT
+static void
+bbr_update_cycle(microtcp_sock_t *socket, const microtcp_ack_sample_t *sample)
+{
+    bbr_t *b = bbr(socket);
+    int next = sample->now_us - b->cycle_stamp_us > b->min_rtt_us;
+
+    //the draining phase may end as soon as the queue is gone
+    if(b->pacing_gain < 1 && sample->in_flight <= bbr_bdp(socket, 1)) next = 1;
+    if(!next) return;
+
+    b->cycle_idx = (b->cycle_idx + 1) % BBR_CYCLE_LEN;
+    b->cycle_stamp_us = sample->now_us;
+    b->pacing_gain = bbr_pacing_gain[b->cycle_idx];
+}
+
+static void
+bbr_on_ack(microtcp_sock_t *socket, const microtcp_ack_sample_t *sample)
+{
+    bbr_t *b = bbr(socket);
+    uint64_t now = sample->now_us;
+    int round_start = 0;
+    int rtt_expired;
+    size_t target;
+
+    //a round ends when a segment sent after it started is delivered
+    if(sample->delivery_rate != 0 && sample->prior_delivered >= b->next_round_delivered){
+        b->next_round_delivered = sample->delivered;
+        b->round_count++;
+        b->bw[b->round_count % BBR_BW_ROUNDS] = 0;
+        round_start = 1;
+    }
+
+    //app limited samples only count when they show more than we know of
+    if(sample->delivery_rate != 0 && (!sample->app_limited || sample->delivery_rate >= bbr_max_bw(b))){
+        if(sample->delivery_rate > b->bw[b->round_count % BBR_BW_ROUNDS]){
+            b->bw[b->round_count % BBR_BW_ROUNDS] = sample->delivery_rate;
+        }
+    }
+
+    //STARTUP is over when three rounds in a row add less than 25%
+    if(!b->full_pipe && round_start && !sample->app_limited){
+        if(bbr_max_bw(b) >= b->full_bw * 5 / 4){
+            b->full_bw = bbr_max_bw(b);
+            b->full_bw_count = 0;
+        }else if(++b->full_bw_count >= 3){
+            b->full_pipe = 1;
+        }
+    }
+    if(b->mode == BBR_STARTUP && b->full_pipe){
+        bbr_set_mode(b, BBR_DRAIN, now);
+        socket->comgestion_state = congestion_avoidance;
+    }
+    if(b->mode == BBR_DRAIN && sample->in_flight <= bbr_bdp(socket, 1)){
+        bbr_set_mode(b, BBR_PROBE_BW, now);
+    }
+    if(b->mode == BBR_PROBE_BW){
+        bbr_update_cycle(socket, sample);
+    }
+
+    //only a min RTT that was seen can grow old, the first sample of a
+    //connection starts the window whatever the clock reads
+    rtt_expired = b->min_rtt_us != 0 && now > b->min_rtt_stamp_us + BBR_MIN_RTT_WIN_US;
+    if(sample->rtt_us != 0 && (b->min_rtt_us == 0 || sample->rtt_us <= b->min_rtt_us || rtt_expired)){
+        b->min_rtt_us = sample->rtt_us;
+        b->min_rtt_stamp_us = now;
+    }
+
+    //the min RTT has not been seen for a while, drain everything to measure it
+    if(rtt_expired && b->mode != BBR_PROBE_RTT){
+        b->prior_cwnd = socket->cwnd;
+        bbr_set_mode(b, BBR_PROBE_RTT, now);
+    }
+    if(b->mode == BBR_PROBE_RTT){
+        if(b->probe_rtt_done_us == 0 && sample->in_flight <= BBR_MIN_CWND(socket->mss)){
+            b->probe_rtt_done_us = now + BBR_PROBE_RTT_US;
+        }else if(b->probe_rtt_done_us != 0 && now >= b->probe_rtt_done_us){
+            b->min_rtt_stamp_us = now;
+            if(socket->cwnd < b->prior_cwnd) socket->cwnd = b->prior_cwnd;
+            bbr_set_mode(b, b->full_pipe ? BBR_PROBE_BW : BBR_STARTUP, now);
+        }
+    }
+
+    //the window was inflated during the recovery, back to where it was
+    if(sample->exit_recovery){
+        socket->cwnd = b->prior_cwnd;
+    }
+    //the sender resent everything a timeout found in flight, the window it
+    //collapsed to one segment grows back to at least what it was
+    if(b->rto_recovery && !socket->rto_recovery){
+        b->rto_recovery = 0;
+        if(socket->cwnd < b->prior_cwnd) socket->cwnd = b->prior_cwnd;
+    }
+
+    //the window follows the model, growing by what was acked until it gets there
+    target = bbr_bdp(socket, b->cwnd_gain) + 3 * socket->mss;
+    if(b->mode == BBR_PROBE_RTT){
+        target = BBR_MIN_CWND(socket->mss);
+        if(socket->cwnd > target) socket->cwnd = target;
+    }else if(socket->comgestion_state == fast_recovery){
+        //packet conservation, the window counts from snd_una so every
+        //duplicate ACK lets one segment replace the one that left
+        if(sample->acked == 0) socket->cwnd += socket->mss;
+    }else if(b->full_pipe){
+        socket->cwnd = socket->cwnd + sample->acked < target ? socket->cwnd + sample->acked : target;
+    }else if(socket->cwnd < target || sample->delivered < MICROTCP_INIT_CWND(socket->mss)){
+        socket->cwnd += sample->acked;
+    }
+    if(socket->cwnd < BBR_MIN_CWND(socket->mss)) socket->cwnd = BBR_MIN_CWND(socket->mss);
+}
+
+static void
+bbr_on_loss(microtcp_sock_t *socket)
+{
+    bbr(socket)->prior_cwnd = socket->cwnd;
+}
+
+//a timeout in the recovery of another keeps the window from before the first
+static void
+bbr_on_timeout(microtcp_sock_t *socket)
+{
+    bbr_t *b = bbr(socket);
+
+    if(!b->rto_recovery || socket->cwnd > b->prior_cwnd) b->prior_cwnd = socket->cwnd;
+    b->rto_recovery = 1;
+    socket->cwnd = socket->mss;
+}
+
+static uint64_t
+bbr_pacing_rate(microtcp_sock_t *socket)
+{
+    bbr_t *b = bbr(socket);
+    uint64_t bw = bbr_max_bw(b);
+    uint64_t rtt_us = b->min_rtt_us ? b->min_rtt_us : (socket->srtt_us ? socket->srtt_us : 1000);
+
+    //no bandwidth sample yet, pace the initial window over one RTT
+    if(bw == 0) return (uint64_t) (BBR_HIGH_GAIN * MICROTCP_INIT_CWND(socket->mss) * 1e6 / rtt_us);
+    return (uint64_t) (b->pacing_gain * bw);
+}
+
+static size_t
+bbr_get_cwnd(microtcp_sock_t *socket)
+{
+    return socket->cwnd;
+}
+
+const microtcp_cc_ops_t microtcp_cc_bbr = {
+    .name = "bbr",
+    .init = bbr_init,
+    .on_ack = bbr_on_ack,
+    .on_loss = bbr_on_loss,
+    .on_timeout = bbr_on_timeout,
+    .pacing_rate = bbr_pacing_rate,
+    .get_cwnd = bbr_get_cwnd,
+};
@@ -0,0 +1,193 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * CUBIC (RFC 9438): after a reduction the window follows a cubic function of
+ * the time since the loss, flat around the window the loss happened at and
+ * steep away from it, so it fills a large BDP path in a few RTTs instead of
+ * one segment per RTT. Where Reno would grow faster (short RTTs, small
+ * windows) it follows Reno instead.
+ */
+
+#include <math.h>
+
+#include "microtcp_cc.h"
+
+#define CUBIC_C 0.4             /* scaling constant, segments / s^3 */
+#define CUBIC_BETA 0.7          /* window kept after a loss */
+
+typedef struct
+{
+  double w_max;                 /* window before the last reduction, in segments */
+  double k;                     /* seconds the cubic takes to get back to origin */
+  double origin;                /* window the cubic plateaus at, in segments */
+  double w_est;                 /* what Reno would have by now, in segments */
+  uint64_t epoch_start_us;      /* start of the current growth epoch, 0 if none */
+  uint64_t srtt_us;             /* smoothed RTT of the ACK samples */
+} cubic_t;
+
+_Static_assert(sizeof(cubic_t) <= sizeof(((microtcp_sock_t *) 0)->cc_priv), "cubic_t must fit in cc_priv");
+
+static cubic_t *
+cubic(microtcp_sock_t *socket)
+{
+    return (cubic_t *) socket->cc_priv;
+}
+
+static size_t
+cubic_reduced_window(microtcp_sock_t *socket)
+{
+    size_t w = (size_t) (socket->cwnd * CUBIC_BETA);
+
+    return w > 2 * socket->mss ? w : 2 * socket->mss;
+}
+
+//remembers where the loss happened, fast convergence gives up some of it
+//when the window did not even reach the last w_max
+static void
+cubic_reduce(microtcp_sock_t *socket)
+{
+    cubic_t *c = cubic(socket);
+    double w = (double) socket->cwnd / socket->mss;
+
+    c->w_max = w < c->w_max ? w * (1.0 + CUBIC_BETA) / 2.0 : w;
+    c->epoch_start_us = 0;
+    socket->ssthresh = cubic_reduced_window(socket);
+}
+
+//the cubic t seconds into the epoch, in segments
+static double
+cubic_window(const cubic_t *c, double t)
+{
+    return c->origin + CUBIC_C * (t - c->k) * (t - c->k) * (t - c->k);
+}
+
+static void
+cubic_init(microtcp_sock_t *socket)
+{
+    socket->comgestion_state = slow_start;
+    socket->cwnd = MICROTCP_INIT_CWND(socket->mss);
+    socket->ssthresh = MICROTCP_INIT_SSTHRESH;
+}
+
+static void
+cubic_on_ack(microtcp_sock_t *socket, const microtcp_ack_sample_t *sample)
+{
+    cubic_t *c = cubic(socket);
+    double cwnd = (double) socket->cwnd / socket->mss;
+    double t;
+    double target;
+
+    if(sample->rtt_us != 0){
+        c->srtt_us = c->srtt_us == 0 ? sample->rtt_us : (7 * c->srtt_us + sample->rtt_us) / 8;
+    }
+
+    //duplicate ACKs keep the recovery going like in Reno
+    if(sample->acked == 0){
+        if(socket->comgestion_state == fast_recovery) socket->cwnd += socket->mss;
+        return;
+    }
+    if(sample->exit_recovery){
+        socket->cwnd = socket->ssthresh;
+        return;
+    }
+    if(socket->comgestion_state == fast_recovery) return;
+
+    if(socket->comgestion_state == slow_start){
+        //a delayed ACK counts for every segment it acknowledges
+        socket->cwnd += sample->acked;
+        if(socket->cwnd >= socket->ssthresh){
+#ifdef DEBUGPRINTS
+            printf("\nFrom slow start to congestion avoidance\n");
+#endif
+            socket->comgestion_state = congestion_avoidance;
+        }
+        return;
+    }
+
+    if(c->epoch_start_us == 0){
+        c->epoch_start_us = sample->now_us;
+        if(cwnd < c->w_max){
+            c->k = cbrt((c->w_max - cwnd) / CUBIC_C);
+            c->origin = c->w_max;
+        }else{
+            c->k = 0;
+            c->origin = cwnd;
+        }
+        c->w_est = cwnd;
+    }
+
+    //the TCP friendly region: where Reno would have a larger window by now
+    //the window is Reno's, w_est segments of mss bytes
+    t = (sample->now_us - c->epoch_start_us) / 1e6;
+    c->w_est += 3.0 * (1.0 - CUBIC_BETA) / (1.0 + CUBIC_BETA) * sample->acked / socket->mss / cwnd;
+    if(c->w_est > cubic_window(c, t)){
+        if(c->w_est > cwnd) socket->cwnd = (size_t) (c->w_est * socket->mss);
+        return;
+    }
+
+    //where the cubic will be one RTT from now
+    target = cubic_window(c, t + c->srtt_us / 1e6);
+    if(target > 1.5 * cwnd) target = 1.5 * cwnd;
+
+    if(target > cwnd){
+        socket->cwnd += (size_t) ((target - cwnd) / cwnd * sample->acked) + 1;
+    }else{
+        socket->cwnd += sample->acked / (100 * (size_t) cwnd) + 1;
+    }
+}
+
+static void
+cubic_on_loss(microtcp_sock_t *socket)
+{
+    cubic_reduce(socket);
+    socket->cwnd = socket->ssthresh + 3 * socket->mss;
+}
+
+static void
+cubic_on_timeout(microtcp_sock_t *socket)
+{
+    cubic_reduce(socket);
+    socket->comgestion_state = slow_start;
+    socket->cwnd = socket->mss;
+}
+
+static uint64_t
+cubic_pacing_rate(microtcp_sock_t *socket)
+{
+    (void) socket;
+    return 0;
+}
+
+static size_t
+cubic_get_cwnd(microtcp_sock_t *socket)
+{
+    return socket->cwnd;
+}
+
+const microtcp_cc_ops_t microtcp_cc_cubic = {
+    .name = "cubic",
+    .init = cubic_init,
+    .on_ack = cubic_on_ack,
+    .on_loss = cubic_on_loss,
+    .on_timeout = cubic_on_timeout,
+    .pacing_rate = cubic_pacing_rate,
+    .get_cwnd = cubic_get_cwnd,
+};
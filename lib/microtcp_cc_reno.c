@@ -0,0 +1,111 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * NewReno: slow start up to ssthresh, then one segment per RTT. A triple
+ * duplicate ACK halves the window, a timeout drops it to one segment.
+ */
+
+#include "microtcp_cc.h"
+
+//half the window, but never less than two segments
+static size_t
+reno_half_window(microtcp_sock_t *socket)
+{
+    return socket->cwnd / 2 > 2 * socket->mss ? socket->cwnd / 2 : 2 * socket->mss;
+}
+
+static void
+reno_init(microtcp_sock_t *socket)
+{
+    socket->comgestion_state = slow_start;
+    socket->cwnd = MICROTCP_INIT_CWND(socket->mss);
+    socket->ssthresh = MICROTCP_INIT_SSTHRESH;
+}
+
+static void
+reno_on_ack(microtcp_sock_t *socket, const microtcp_ack_sample_t *sample)
+{
+    //every further duplicate ACK is a segment that left the network
+    if(sample->acked == 0){
+        if(socket->comgestion_state == fast_recovery) socket->cwnd += socket->mss;
+        return;
+    }
+
+    if(sample->exit_recovery){
+        socket->cwnd = socket->ssthresh;
+        return;
+    }
+
+    //grow by what the ack covers, a delayed ACK counts for every segment it acknowledges
+    if(socket->comgestion_state == slow_start) {
+        socket->cwnd += sample->acked;
+        if(socket->cwnd >= socket->ssthresh){
+#ifdef  DEBUGPRINTS
+            printf("\nFrom slow start to congestion avoidance\n");
+#endif
+            socket->comgestion_state = congestion_avoidance;
+        }
+    }else if(socket->comgestion_state == congestion_avoidance){
+        //one segment per window worth of acknowledged bytes
+        socket->cwnd += (size_t) socket->mss * sample->acked / socket->cwnd + 1;
+    }
+}
+
+static void
+reno_on_loss(microtcp_sock_t *socket)
+{
+    socket->ssthresh = reno_half_window(socket);
+    socket->cwnd = socket->ssthresh + 3 * socket->mss;
+}
+
+static void
+reno_on_timeout(microtcp_sock_t *socket)
+{
+#ifdef DEBUGPRINTS
+    if(socket->comgestion_state != slow_start) printf("\nFrom congestion avoidance or fast recovery to slow start\n");
+#endif
+    socket->comgestion_state = slow_start;
+    socket->ssthresh = reno_half_window(socket);
+    socket->cwnd = socket->mss;
+}
+
+static uint64_t
+reno_pacing_rate(microtcp_sock_t *socket)
+{
+    (void) socket;
+    return 0;
+}
+
+static size_t
+reno_get_cwnd(microtcp_sock_t *socket)
+{
+    return socket->cwnd;
+}
+
+const microtcp_cc_ops_t microtcp_cc_reno = {
+    .name = "reno",
+    .init = reno_init,
+    .on_ack = reno_on_ack,
+    .on_loss = reno_on_loss,
+    .on_timeout = reno_on_timeout,
+    .pacing_rate = reno_pacing_rate,
+    .get_cwnd = reno_get_cwnd,
+};
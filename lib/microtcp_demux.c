@@ -0,0 +1,232 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "microtcp_demux.h"
+
+//the key of a peer address as the table stores it, the stored bytes of the
+//address with the padding of an IPv4 one zeroed
+static void
+addr_key(const struct sockaddr *address, uint8_t peer[sizeof(struct sockaddr)])
+{
+    memcpy(peer, address, sizeof(struct sockaddr));
+    if(address->sa_family == AF_INET){
+        memset(((struct sockaddr_in *) peer)->sin_zero, 0, sizeof(((struct sockaddr_in *) peer)->sin_zero));
+    }
+}
+
+//hash of a key, never 0 which marks an empty slot. The two halves of the
+//address and the id go through the 64-bit finalizer of MurmurHash3, the
+//low bits pick the slot
+static uint32_t
+key_hash(const uint8_t peer[sizeof(struct sockaddr)], uint32_t conn_id)
+{
+    uint64_t w[2];
+    uint64_t h;
+
+    memcpy(w, peer, sizeof(w));
+    h = w[0] ^ (w[1] * 0x9e3779b97f4a7c15ULL) ^ ((uint64_t) conn_id << 16);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return (uint32_t) h != 0 ? (uint32_t) h : 1;
+}
+
+//returns the slot holding the key, or the empty slot where a lookup of it
+//stops and an insert puts it
+static microtcp_demux_slot_t *
+slot_find(const microtcp_demux_t *demux, const uint8_t peer[sizeof(struct sockaddr)], uint32_t conn_id,
+          uint32_t hash)
+{
+    size_t mask = demux->nslots - 1;
+    size_t i = hash & mask;
+    microtcp_demux_slot_t *slot;
+
+    while(1){
+        slot = &demux->slots[i];
+        if(slot->hash == 0) return slot;
+        if(slot->hash == hash && slot->conn_id == conn_id && memcmp(slot->peer, peer, sizeof(slot->peer)) == 0){
+            return slot;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+int
+microtcp_demux_match (const microtcp_sock_t *conn, const struct sockaddr *address,
+                      uint32_t conn_id)
+{
+    const struct sockaddr_in *a = (const struct sockaddr_in *) &conn->peerAdress;
+    const struct sockaddr_in *b = (const struct sockaddr_in *) address;
+
+    if(conn_id != 0 && conn_id != conn->conn_id) return 0;
+    if(conn_id == 0 && conn->state != SYN_RECEIVED) return 0;
+    if(conn->peerAdress.sa_family != address->sa_family) return 0;
+    //the padding of an IPv4 address is not part of it
+    if(address->sa_family == AF_INET){
+        return a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr;
+    }
+    return memcmp(&conn->peerAdress, address, sizeof(struct sockaddr)) == 0;
+}
+
+microtcp_demux_t *
+microtcp_demux_new (size_t backlog)
+{
+    microtcp_demux_t *demux = malloc(sizeof(*demux));
+
+    if(demux == NULL) return NULL;
+
+    demux->nslots = MICROTCP_DEMUX_SLOTS;
+    demux->count = 0;
+    demux->slots = calloc(demux->nslots, sizeof(*demux->slots));
+    demux->accepted = malloc(backlog * sizeof(*demux->accepted));
+    demux->handshaking = malloc(backlog * sizeof(*demux->handshaking));
+    if(demux->slots == NULL || demux->accepted == NULL || demux->handshaking == NULL){
+        free(demux->slots);
+        free(demux->accepted);
+        free(demux->handshaking);
+        free(demux);
+        return NULL;
+    }
+
+    demux->listener = NULL;
+    demux->accept_head = 0;
+    demux->accept_count = 0;
+    demux->handshake_count = 0;
+    demux->handshake_us = 0;
+    demux->backlog = backlog;
+    demux->pending = 0;
+    demux->users = 1;
+    demux->shard = 0;
+    demux->next_id = 0;
+
+    return demux;
+}
+
+uint32_t
+microtcp_demux_new_id (microtcp_demux_t *demux)
+{
+    demux->next_id++;
+    return (demux->next_id << 8) | ((demux->shard + 1) & 0xff);
+}
+
+void
+microtcp_demux_free (microtcp_demux_t *demux)
+{
+    free(demux->slots);
+    free(demux->accepted);
+    free(demux->handshaking);
+    free(demux);
+}
+
+microtcp_sock_t *
+microtcp_demux_lookup (const microtcp_demux_t *demux, const struct sockaddr *address,
+                       uint32_t conn_id)
+{
+    uint8_t peer[sizeof(struct sockaddr)];
+    uint32_t hash;
+
+    addr_key(address, peer);
+    hash = key_hash(peer, conn_id);
+
+    return slot_find(demux, peer, conn_id, hash)->conn;
+}
+
+//doubles the table, every key goes to the slot its kept hash picks
+static int
+demux_grow(microtcp_demux_t *demux)
+{
+    microtcp_demux_slot_t *old = demux->slots;
+    size_t nold = demux->nslots;
+    size_t i;
+
+    demux->slots = calloc(2 * nold, sizeof(*demux->slots));
+    if(demux->slots == NULL){
+        demux->slots = old;
+        return -1;
+    }
+    demux->nslots = 2 * nold;
+
+    for(i = 0; i < nold; i++){
+        if(old[i].hash != 0) *slot_find(demux, old[i].peer, old[i].conn_id, old[i].hash) = old[i];
+    }
+    free(old);
+
+    return 0;
+}
+
+int
+microtcp_demux_insert (microtcp_demux_t *demux, const struct sockaddr *address,
+                       uint32_t conn_id, microtcp_sock_t *conn)
+{
+    microtcp_demux_slot_t *slot;
+    uint8_t peer[sizeof(struct sockaddr)];
+    uint32_t hash;
+
+    //at most half full, a lookup probes about 1.5 slots
+    if(2 * (demux->count + 1) > demux->nslots && demux_grow(demux) == -1) return -1;
+
+    addr_key(address, peer);
+    hash = key_hash(peer, conn_id);
+    slot = slot_find(demux, peer, conn_id, hash);
+    if(slot->hash == 0) demux->count++;
+
+    slot->hash = hash;
+    slot->conn_id = conn_id;
+    memcpy(slot->peer, peer, sizeof(slot->peer));
+    slot->conn = conn;
+
+    return 0;
+}
+
+void
+microtcp_demux_remove (microtcp_demux_t *demux, const struct sockaddr *address,
+                       uint32_t conn_id)
+{
+    size_t mask = demux->nslots - 1;
+    uint8_t peer[sizeof(struct sockaddr)];
+    microtcp_demux_slot_t *slot;
+    size_t hole;
+    size_t i;
+    size_t home;
+
+    addr_key(address, peer);
+    slot = slot_find(demux, peer, conn_id, key_hash(peer, conn_id));
+    if(slot->hash == 0) return;
+    demux->count--;
+
+    //every slot of the run after the hole that probed past it moves back
+    //into it, which leaves a new hole where it was
+    hole = slot - demux->slots;
+    i = hole;
+    while(1){
+        i = (i + 1) & mask;
+        if(demux->slots[i].hash == 0) break;
+        home = demux->slots[i].hash & mask;
+        //it stays if its home slot lies cyclically in (hole, i]
+        if(((i - home) & mask) < ((i - hole) & mask)) continue;
+        demux->slots[hole] = demux->slots[i];
+        hole = i;
+    }
+    demux->slots[hole].hash = 0;
+    demux->slots[hole].conn = NULL;
+}
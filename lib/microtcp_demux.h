@@ -0,0 +1,115 @@
+/*
+ * microtcp, a lightweight implementation of TCP for teaching,
+ * and academic purposes.
+ *
+ * Copyright (C) 2015-2017  Manolis Surligas <surligas@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LIB_MICROTCP_DEMUX_H_
+#define LIB_MICROTCP_DEMUX_H_
+
+#include "microtcp.h"
+
+/*
+ * One slot of the connection table: the key inline, so a lookup touches
+ * nothing but the slots it probes, and the connection it leads to. 32 bytes,
+ * two to a cache line. The key is the peer address as it is stored in
+ * peerAdress, with its padding zeroed, and the connection id. Only an IPv4
+ * address fits, microtcp_listen() takes no other. Its hash is kept to tell most other keys apart without comparing them
+ * and to move the slot when the table grows.
+ */
+typedef struct
+{
+  uint32_t hash;                /**< Hash of the key, 0 for an empty slot */
+  uint32_t conn_id;             /**< Connection id */
+  uint8_t peer[sizeof(struct sockaddr)]; /**< Peer address */
+  microtcp_sock_t *conn;        /**< The connection */
+} microtcp_demux_slot_t;
+
+/*
+ * What a listening socket shares with its connections: they all send and
+ * receive over its UDP socket, and whichever of them reads a datagram looks
+ * its peer up here to hand it to the connection it belongs to. A SYN from a
+ * peer not in the table starts a new connection, which is queued for
+ * microtcp_accept_connection() once its handshake completes. A connection
+ * is in the table under the id it picked for itself and, until its
+ * handshake completes, under no id (0) too, for the SYNs its client resends
+ * before it learns the id. Past that a SYN from the same address and port
+ * starts a new connection.
+ *
+ * The table is open addressing with linear probing, at most half full. A
+ * removed slot is filled by shifting back the slots after it that probed
+ * past it, so there are no tombstones and a lookup stops at the first empty
+ * slot.
+ */
+typedef struct microtcp_demux
+{
+  microtcp_demux_slot_t *slots; /**< The connection table */
+  size_t nslots;                /**< Slots of the table, power of 2 */
+  size_t count;                 /**< Connections in the table */
+
+  microtcp_sock_t *listener;    /**< The listening socket, NULL once it is shut down */
+  microtcp_sock_t **accepted;   /**< Ring of backlog slots, the established connections not accepted yet */
+  size_t accept_head;           /**< Ring index of the oldest of them */
+  size_t accept_count;          /**< How many there are */
+  microtcp_sock_t **handshaking; /**< backlog slots, the connections still in their handshake, in no order */
+  size_t handshake_count;       /**< How many there are */
+  uint64_t handshake_us;        /**< No SYN + ACK of theirs needs resending before this, 0 if none */
+  size_t backlog;               /**< Most connections handshaking or waiting to be accepted */
+  size_t pending;               /**< Connections handshaking or waiting to be accepted */
+  size_t users;                 /**< The listening socket and every connection still sharing its UDP socket */
+  uint32_t shard;               /**< Index of the listening socket among those of microtcp_listen_shards(), 0 if alone */
+  uint32_t next_id;             /**< Counter the connection ids are made from */
+} microtcp_demux_t;
+
+//returns a demux with an empty table and accept queue and one user, or NULL
+//if malloc fails
+microtcp_demux_t *
+microtcp_demux_new (size_t backlog);
+
+void
+microtcp_demux_free (microtcp_demux_t *demux);
+
+//returns 1 if a datagram from address carrying conn_id is for conn, 0 if
+//not. One without an id (0) is for the connection of its peer while it is
+//in its handshake
+int
+microtcp_demux_match (const microtcp_sock_t *conn, const struct sockaddr *address,
+                      uint32_t conn_id);
+
+//returns a new connection id: the counter in the upper 24 bits, the index
+//of the listening socket plus one in the low byte, never 0
+uint32_t
+microtcp_demux_new_id (microtcp_demux_t *demux);
+
+//returns the connection of the peer address with conn_id, or NULL if there
+//is none
+microtcp_sock_t *
+microtcp_demux_lookup (const microtcp_demux_t *demux, const struct sockaddr *address,
+                       uint32_t conn_id);
+
+//adds conn under the peer address and conn_id, returns 0 for success or -1
+//if the table cannot grow
+int
+microtcp_demux_insert (microtcp_demux_t *demux, const struct sockaddr *address,
+                       uint32_t conn_id, microtcp_sock_t *conn);
+
+//removes the connection of the peer address with conn_id, if there is one
+void
+microtcp_demux_remove (microtcp_demux_t *demux, const struct sockaddr *address,
+                       uint32_t conn_id);
+
+#endif /* LIB_MICROTCP_DEMUX_H_ */
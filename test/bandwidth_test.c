@@ -18,6 +18,8 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -33,11 +35,61 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 
 #include "../lib/microtcp.h"
+#include "../lib/microtcp_demux.h"
 
 #define CHUNK_SIZE 4096
 
+/* Model benchmark of the congestion control modules, see benchmark_cc() */
+#define BENCH_RING (1 << 18)            /* max packets in flight */
+#define BENCH_DURATION_US 120000000ULL  /* simulated time, the second half is measured */
+#define BENCH_CLOCK_START_US 3600000000ULL /* the simulated clock starts where a monotonic one an hour after boot is */
+
+/* Benchmark of the connection table of a listening socket, see benchmark_demux() */
+#define BENCH_LOOKUPS 4000000           /* lookups timed for every table size */
+
+/* Multi-client microTCP server and client, see server_microtcp_shards() */
+#define SHARD_CONNS 1024                /* most connections a shard serves at once */
+#define SHARD_CHUNK (1 << 16)           /* bytes read from a connection at a time */
+
+typedef struct
+{
+    microtcp_sock_t *listener;
+    int cpu;                    /* the core its thread runs on */
+    size_t clients;             /* connections to serve, of all the shards */
+    atomic_size_t *done;        /* how many of them have closed */
+    size_t served;              /* connections this shard served */
+    uint64_t bytes;             /* and the bytes it received from them */
+    struct timespec first;      /* when it accepted its first one */
+    struct timespec last;       /* when its last one closed */
+} shard_t;
+
+typedef struct
+{
+    const char *serverip;
+    uint16_t server_port;
+    const char *cc;
+    const uint8_t *data;        /* the file, sent whole by every client */
+    size_t len;
+    int failed;
+} client_t;
+
+typedef struct
+{
+    uint64_t sent_us;
+    uint64_t ack_us;
+    uint64_t seq;
+    uint64_t tx_delivered;      /* delivery state when it was sent, for the rate samples */
+    uint64_t tx_delivered_us;
+    uint64_t tx_first_sent_us;
+    int lost;
+} bench_pkt_t;
+
 static inline void
 print_statistics (ssize_t received, struct timespec start, struct timespec end)
 {
@@ -49,6 +101,303 @@ print_statistics (ssize_t received, struct timespec start, struct timespec end)
     printf ("Throughput achieved: %f MB/s\n", megabytes / elapsed);
 }
 
+/*
+ * Runs the congestion control module called name over a simulated path: a
+ * bottleneck of link_mbit with a drop-tail queue of a quarter of the BDP and
+ * a base RTT of rtt_ms. Every packet is an MSS, the sender is modelled like
+ * microtcp's: the window covers everything from the oldest unacknowledged
+ * packet, a module with a pacing rate has its packets spaced by it, a drop
+ * starts fast recovery once per window, ACKs behind the hole are duplicate
+ * ACKs and the recovery ends when the ACK passes the highest packet sent
+ * when it started. Every ACK carries a delivery rate sample computed the way
+ * the sender does. No real time passes, the module only sees the simulated
+ * clock through the ACK samples.
+ *
+ * Returns the steady state goodput in Mbit/s and stores the average RTT
+ * seen over the same time in avg_rtt_ms, or returns -1 if name is unknown.
+ */
+static double
+benchmark_cc (const char *name, double link_mbit, double rtt_ms, double *avg_rtt_ms)
+{
+    microtcp_sock_t *sock;
+    bench_pkt_t *ring;
+    microtcp_ack_sample_t sample;
+    double rate = link_mbit * 1e6 / 8;                  /* bytes/s */
+    uint64_t rtt_us = rtt_ms * 1000;
+    double queue = rate * rtt_us / 1e6 / 4;             /* bytes */
+    uint64_t now = BENCH_CLOCK_START_US;
+    double link_free = BENCH_CLOCK_START_US;            /* us */
+    double pace_next = BENCH_CLOCK_START_US;            /* us */
+    uint64_t pacing;
+    uint64_t next_seq = 0;
+    uint64_t una = 0;
+    uint64_t recover = 0;
+    uint64_t dup_acked = 0;
+    uint64_t delivered = 0;
+    uint64_t delivered_us = 0;
+    uint64_t first_sent_us = 0;
+    uint64_t interval;
+    uint64_t measured = 0;
+    uint64_t rtt_sum = 0;
+    uint64_t rtt_count = 0;
+    size_t head = 0;
+    size_t count = 0;
+    size_t cwnd_pkts;
+    int in_recovery = 0;
+    double backlog;
+    bench_pkt_t *pkt;
+
+    sock = calloc (1, sizeof(*sock));
+    ring = malloc (BENCH_RING * sizeof(*ring));
+    if (sock) {
+        sock->mss = MICROTCP_MSS;
+    }
+    if (!sock || !ring || microtcp_set_congestion_control (sock, name) == -1) {
+        free (sock);
+        free (ring);
+        return -1;
+    }
+
+    while (now < BENCH_CLOCK_START_US + BENCH_DURATION_US) {
+        /* fill the window, as fast as the pacing rate lets us */
+        cwnd_pkts = sock->cc->get_cwnd (sock) / MICROTCP_MSS;
+        if (cwnd_pkts == 0) {
+            cwnd_pkts = 1;
+        }
+        pacing = sock->cc->pacing_rate (sock);
+        if (pace_next < now) {
+            pace_next = now;
+        }
+        while (next_seq - una < cwnd_pkts && count < BENCH_RING
+               && (pacing == 0 || pace_next <= now)) {
+            if (count == 0) {
+                first_sent_us = delivered_us = now;
+            }
+            pkt = &ring[(head + count) & (BENCH_RING - 1)];
+            pkt->sent_us = now;
+            pkt->seq = next_seq++;
+            pkt->tx_delivered = delivered;
+            pkt->tx_delivered_us = delivered_us;
+            pkt->tx_first_sent_us = first_sent_us;
+            backlog = link_free > now ? (link_free - now) * rate / 1e6 : 0;
+            if (backlog + MICROTCP_MSS > queue) {
+                /* dropped, the duplicate ACKs reveal it one RTT later */
+                pkt->lost = 1;
+                pkt->ack_us = (uint64_t) (link_free > now ? link_free : now) + rtt_us;
+            }
+            else {
+                pkt->lost = 0;
+                link_free = (link_free > now ? link_free : now) + MICROTCP_MSS * 1e6 / rate;
+                pkt->ack_us = (uint64_t) link_free + rtt_us;
+            }
+            if (pacing != 0) {
+                pace_next += MICROTCP_MSS * 1e6 / pacing;
+            }
+            count++;
+        }
+
+        /* the next event, a paced send or an ACK */
+        if (next_seq - una < cwnd_pkts && count < BENCH_RING && pacing != 0
+            && (count == 0 || pace_next < ring[head].ack_us)) {
+            now = (uint64_t) pace_next + 1;
+            continue;
+        }
+        if (count == 0) {
+            /* a window full of lost packets, a module that never opens it stalls */
+            break;
+        }
+        pkt = &ring[head];
+        head = (head + 1) & (BENCH_RING - 1);
+        count--;
+        if (pkt->ack_us > now) {
+            now = pkt->ack_us;
+        }
+
+        if (pkt->lost) {
+            if (!in_recovery) {
+                in_recovery = 1;
+                recover = next_seq;
+                una = pkt->seq;
+                dup_acked = 0;
+                sock->comgestion_state = fast_recovery;
+                sock->cc->on_loss (sock);
+            }
+            /* the retransmission takes the packet's place, it is not counted */
+            continue;
+        }
+
+        if (now >= BENCH_CLOCK_START_US + BENCH_DURATION_US / 2) {
+            measured += MICROTCP_MSS;
+            rtt_sum += now - pkt->sent_us;
+            rtt_count++;
+        }
+
+        if (!in_recovery || pkt->seq + 1 >= recover) {
+            una = pkt->seq + 1;
+        }
+        memset (&sample, 0, sizeof(sample));
+        sample.rtt_us = now - pkt->sent_us;
+        sample.in_flight = (next_seq - una) * MICROTCP_MSS;
+        sample.now_us = now;
+        sample.acked = MICROTCP_MSS;
+
+        /* the packet is delivered, directly or by a SACK */
+        delivered += MICROTCP_MSS;
+        delivered_us = now;
+        first_sent_us = pkt->sent_us;
+        interval = pkt->sent_us - pkt->tx_first_sent_us;
+        if (now - pkt->tx_delivered_us > interval) {
+            interval = now - pkt->tx_delivered_us;
+        }
+        sample.delivered = delivered;
+        sample.prior_delivered = pkt->tx_delivered;
+        if (interval > 0) {
+            sample.delivery_rate = (delivered - pkt->tx_delivered) * 1000000 / interval;
+        }
+
+        if (in_recovery) {
+            if (pkt->seq + 1 < recover) {
+                /* behind the hole, only a duplicate ACK */
+                dup_acked++;
+                sample.acked = 0;
+            }
+            else {
+                in_recovery = 0;
+                sample.acked = (dup_acked + 1) * MICROTCP_MSS;
+                sample.exit_recovery = 1;
+                sock->comgestion_state = congestion_avoidance;
+            }
+        }
+        sock->cc->on_ack (sock, &sample);
+    }
+
+    *avg_rtt_ms = rtt_count ? rtt_sum / (double) rtt_count / 1000 : 0;
+    free (sock);
+    free (ring);
+    return measured * 8 / ((BENCH_DURATION_US / 2) / 1e6) / 1e6;
+}
+
+/*
+ * Reports the steady state goodput and the RTT, base plus queueing delay, of
+ * the congestion control name against Reno over the same simulated path.
+ */
+int
+benchmark_microtcp (const char *name, double link_mbit, double rtt_ms)
+{
+    double reno;
+    double other;
+    double reno_rtt;
+    double other_rtt;
+
+    printf ("Path: %.1f Mbit/s, RTT %.1f ms, BDP %.0f packets, queue BDP/4\n",
+            link_mbit, rtt_ms, link_mbit * 1e6 / 8 * rtt_ms / 1e3 / MICROTCP_MSS);
+
+    reno = benchmark_cc ("reno", link_mbit, rtt_ms, &reno_rtt);
+    other = benchmark_cc (name, link_mbit, rtt_ms, &other_rtt);
+    if (other < 0) {
+        fprintf (stderr, "Unknown congestion control: %s\n", name);
+        return -EXIT_FAILURE;
+    }
+
+    printf ("%-8s %10.2f Mbit/s  %5.1f%% of the link  avg RTT %7.2f ms\n",
+            "reno", reno, 100 * reno / link_mbit, reno_rtt);
+    printf ("%-8s %10.2f Mbit/s  %5.1f%% of the link  avg RTT %7.2f ms\n",
+            name, other, 100 * other / link_mbit, other_rtt);
+    printf ("%s/reno: %.2f\n", name, other / reno);
+
+    return 0;
+}
+
+static double
+elapsed_seconds (struct timespec start, struct timespec end)
+{
+    return end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) * 1e-9;
+}
+
+/*
+ * Fills the connection table of a listening socket with 1k, 10k and 100k
+ * peers, IPv4 addresses and ports picked at random, and times lookups of
+ * them in random order, the work of every datagram a listening socket reads,
+ * and the remove and insert of every peer, the work of a connection closing
+ * and another one arriving. The table never looks into a connection, so they
+ * are only distinct addresses.
+ */
+int
+benchmark_demux (void)
+{
+    static const size_t sizes[] = { 1000, 10000, 100000 };
+    struct sockaddr_in *peers;
+    uint32_t *order;
+    char *conns;
+    microtcp_demux_t *demux;
+    struct timespec start;
+    struct timespec end;
+    size_t found;
+    size_t n;
+    size_t i;
+    size_t s;
+
+    srand (time (NULL));
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        n = sizes[s];
+        peers = calloc (n, sizeof(*peers));
+        order = malloc (BENCH_LOOKUPS * sizeof(*order));
+        conns = malloc (n);
+        demux = microtcp_demux_new (1);
+        if (peers == NULL || order == NULL || conns == NULL || demux == NULL) {
+            perror ("benchmark_demux malloc");
+            exit (EXIT_FAILURE);
+        }
+
+        /* The index in the low bits keeps every address distinct */
+        for (i = 0; i < n; i++) {
+            peers[i].sin_family = AF_INET;
+            peers[i].sin_addr.s_addr = htonl (((uint32_t) rand () << 17) ^ (uint32_t) i);
+            peers[i].sin_port = htons (1024 + rand () % 64512);
+            if (microtcp_demux_insert (demux, (struct sockaddr *) &peers[i], 0,
+                                       (microtcp_sock_t *) &conns[i]) == -1) {
+                perror ("benchmark_demux insert");
+                exit (EXIT_FAILURE);
+            }
+        }
+        for (i = 0; i < BENCH_LOOKUPS; i++) {
+            order[i] = rand () % n;
+        }
+
+        found = 0;
+        clock_gettime (CLOCK_MONOTONIC_RAW, &start);
+        for (i = 0; i < BENCH_LOOKUPS; i++) {
+            found += microtcp_demux_lookup (demux, (struct sockaddr *) &peers[order[i]], 0)
+                     == (microtcp_sock_t *) &conns[order[i]];
+        }
+        clock_gettime (CLOCK_MONOTONIC_RAW, &end);
+        if (found != BENCH_LOOKUPS) {
+            fprintf (stderr, "Connection table lost %zu peers\n", BENCH_LOOKUPS - found);
+            exit (EXIT_FAILURE);
+        }
+        printf ("%7zu connections %8.2f Mlookups/s", n,
+                BENCH_LOOKUPS / elapsed_seconds (start, end) / 1e6);
+
+        clock_gettime (CLOCK_MONOTONIC_RAW, &start);
+        for (i = 0; i < n; i++) {
+            microtcp_demux_remove (demux, (struct sockaddr *) &peers[order[i]], 0);
+            microtcp_demux_insert (demux, (struct sockaddr *) &peers[order[i]], 0,
+                                   (microtcp_sock_t *) &conns[order[i]]);
+        }
+        clock_gettime (CLOCK_MONOTONIC_RAW, &end);
+        printf ("  %8.2f Mremove+insert/s  %7zu slots\n",
+                n / elapsed_seconds (start, end) / 1e6, demux->nslots);
+
+        microtcp_demux_free (demux);
+        free (peers);
+        free (order);
+        free (conns);
+    }
+
+    return 0;
+}
+
 int
 server_tcp (uint16_t listen_port, const char *file)
 {
@@ -158,7 +507,7 @@ server_tcp (uint16_t listen_port, const char *file)
 }
 
 int
-server_microtcp (uint16_t listen_port, const char *file)
+server_microtcp (uint16_t listen_port, const char *file, int engine)
 {
     uint8_t *buffer;
     FILE *fp;
@@ -226,6 +575,10 @@ server_microtcp (uint16_t listen_port, const char *file)
         exit(EXIT_FAILURE);
     }
 
+    if(engine && microtcp_engine_start(&sock) == -1){
+        perror("microtcp_engine_start");
+    }
+
     clock_gettime (CLOCK_MONOTONIC_RAW, &start_time);
     while ((received = microtcp_recv(&sock/*our socket*/, buffer, CHUNK_SIZE, 0)) > 0) {
         written = fwrite (buffer, sizeof(uint8_t), received, fp);
@@ -338,8 +691,181 @@ client_tcp (const char *serverip, uint16_t server_port, const char *file)
     return 0;
 }
 
+/*
+ * One shard of the multi-client server, run by a thread of its own pinned to
+ * one core. It serves the listening socket and its connections in turn,
+ * never blocking on one of them, and only sleeps in poll() when a whole
+ * round found nothing to do. The wait is short so the timers of the
+ * connections still run. The data received is discarded.
+ */
+static void *
+shard_serve (void *arg)
+{
+    shard_t *shard = arg;
+    microtcp_sock_t *conns[SHARD_CONNS];
+    size_t nconns = 0;
+    size_t i;
+    ssize_t received;
+    uint8_t *buffer;
+    int progress;
+    cpu_set_t cpus;
+    struct pollfd pfd;
+
+    CPU_ZERO (&cpus);
+    CPU_SET (shard->cpu, &cpus);
+    pthread_setaffinity_np (pthread_self (), sizeof(cpus), &cpus);
+
+    buffer = malloc (SHARD_CHUNK);
+    if (!buffer) {
+        perror ("Allocate application receive buffer");
+        exit (EXIT_FAILURE);
+    }
+
+    while (atomic_load (shard->done) < shard->clients) {
+        progress = 0;
+
+        if (nconns < SHARD_CONNS) {
+            conns[nconns] = microtcp_accept_connection (shard->listener, NULL, NULL, MSG_DONTWAIT);
+            if (conns[nconns] != NULL) {
+                if (shard->served + nconns == 0) {
+                    clock_gettime (CLOCK_MONOTONIC_RAW, &shard->first);
+                }
+                nconns++;
+                progress = 1;
+            }
+            else if (errno != EAGAIN) {
+                perror ("microtcp_accept_connection");
+                exit (EXIT_FAILURE);
+            }
+        }
+
+        for (i = 0; i < nconns;) {
+            received = microtcp_recv (conns[i], buffer, SHARD_CHUNK, MSG_DONTWAIT);
+            if (received > 0) {
+                shard->bytes += received;
+                progress = 1;
+                i++;
+                continue;
+            }
+            if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                i++;
+                continue;
+            }
+
+            /* The client is done, or its connection broke */
+            if (received < 0 || conns[i]->state != CLOSING_BY_PEER) {
+                perror ("microtcp_recv");
+            }
+            microtcp_shutdown (conns[i], SHUT_RDWR);
+            free (conns[i]);
+            conns[i] = conns[--nconns];
+            shard->served++;
+            clock_gettime (CLOCK_MONOTONIC_RAW, &shard->last);
+            atomic_fetch_add (shard->done, 1);
+            progress = 1;
+        }
+
+        if (!progress) {
+            pfd.fd = shard->listener->sd;
+            pfd.events = POLLIN;
+            poll (&pfd, 1, 1);
+        }
+    }
+
+    free (buffer);
+    return NULL;
+}
+
+/*
+ * Serves clients connections on listen_port with nshards listening sockets
+ * sharing the port through SO_REUSEPORT, each with a thread of its own on
+ * its own core, and reports the aggregate throughput, from the first
+ * connection accepted to the last one closed. With steer the kernel hands
+ * the datagrams to the sockets by their connection id.
+ */
+int
+server_microtcp_shards (uint16_t listen_port, size_t nshards, size_t clients, int steer)
+{
+    microtcp_sock_t *listeners;
+    shard_t *shards;
+    pthread_t *threads;
+    atomic_size_t done = 0;
+    struct sockaddr_in sin;
+    struct timespec start_time;
+    struct timespec end_time;
+    uint64_t total_bytes = 0;
+    size_t measured = 0;
+    long ncpus = sysconf (_SC_NPROCESSORS_ONLN);
+    size_t i;
+
+    listeners = malloc (nshards * sizeof(*listeners));
+    shards = calloc (nshards, sizeof(*shards));
+    threads = malloc (nshards * sizeof(*threads));
+    if (!listeners || !shards || !threads) {
+        perror ("Allocate the shards");
+        return -EXIT_FAILURE;
+    }
+
+    memset (&sin, 0, sizeof(struct sockaddr_in));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons (listen_port);
+    /* Bind to all available network interfaces */
+    sin.sin_addr.s_addr = INADDR_ANY;
+
+    if (microtcp_listen_shards (listeners, nshards, (struct sockaddr *) &sin,
+                                sizeof(struct sockaddr_in), clients) == -1) {
+        perror ("microtcp_listen_shards");
+        return -EXIT_FAILURE;
+    }
+    if (steer && microtcp_steer_shards (listeners, nshards) == -1) {
+        perror ("microtcp_steer_shards, steering by address instead");
+    }
+
+    printf ("Serving %zu clients with %zu threads...\n", clients, nshards);
+    for (i = 0; i < nshards; i++) {
+        shards[i].listener = &listeners[i];
+        shards[i].cpu = ncpus > 0 ? i % ncpus : 0;
+        shards[i].clients = clients;
+        shards[i].done = &done;
+        if (pthread_create (&threads[i], NULL, shard_serve, &shards[i]) != 0) {
+            perror ("pthread_create");
+            exit (EXIT_FAILURE);
+        }
+    }
+
+    for (i = 0; i < nshards; i++) {
+        pthread_join (threads[i], NULL);
+        microtcp_shutdown (&listeners[i], SHUT_RDWR);
+    }
+
+    for (i = 0; i < nshards; i++) {
+        printf ("Thread %zu: %zu connections, %f MB\n", i, shards[i].served,
+                shards[i].bytes / (1024.0 * 1024.0));
+        if (shards[i].served == 0) {
+            continue;
+        }
+        if (measured == 0 || elapsed_seconds (shards[i].first, start_time) > 0) {
+            start_time = shards[i].first;
+        }
+        if (measured == 0 || elapsed_seconds (end_time, shards[i].last) > 0) {
+            end_time = shards[i].last;
+        }
+        total_bytes += shards[i].bytes;
+        measured++;
+    }
+    if (measured > 0) {
+        print_statistics (total_bytes, start_time, end_time);
+    }
+
+    free (listeners);
+    free (shards);
+    free (threads);
+    return 0;
+}
+
 int
-client_microtcp (const char *serverip, uint16_t server_port, const char *file)
+client_microtcp (const char *serverip, uint16_t server_port, const char *file,
+                 const char *cc, int engine)
 {
     uint8_t *buffer;
     microtcp_sock_t sock;
@@ -375,6 +901,11 @@ client_microtcp (const char *serverip, uint16_t server_port, const char *file)
         }
     }
 
+    if (cc && microtcp_set_congestion_control(&sock, cc) == -1) {
+        fprintf(stderr, "Unknown congestion control: %s\n", cc);
+        exit(EXIT_FAILURE);
+    }
+
     struct sockaddr_in sin;
     memset (&sin, 0, sizeof(struct sockaddr_in));
     sin.sin_family = AF_INET;
@@ -388,6 +919,10 @@ client_microtcp (const char *serverip, uint16_t server_port, const char *file)
         exit(EXIT_FAILURE);
     }
 
+    if(engine && microtcp_engine_start(&sock) == -1){
+        perror("microtcp_engine_start");
+    }
+
     printf ("Starting sending data...\n");
     /* Start sending the data */
     while (!feof (fp)) {
@@ -424,6 +959,121 @@ client_microtcp (const char *serverip, uint16_t server_port, const char *file)
     return 0;
 }
 
+/* One client of client_microtcp_multi(), run by a thread of its own */
+static void *
+client_send (void *arg)
+{
+    client_t *client = arg;
+    microtcp_sock_t sock;
+    struct sockaddr_in sin;
+    size_t sent = 0;
+    size_t chunk;
+
+    sock = microtcp_socket (AF_INET, SOCK_DGRAM, 0);
+    if (sock.state == INVALID) {
+        client->failed = 1;
+        return NULL;
+    }
+    if (client->cc && microtcp_set_congestion_control (&sock, client->cc) == -1) {
+        fprintf (stderr, "Unknown congestion control: %s\n", client->cc);
+        exit (EXIT_FAILURE);
+    }
+
+    memset (&sin, 0, sizeof(struct sockaddr_in));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons (client->server_port);
+    sin.sin_addr.s_addr = inet_addr (client->serverip);
+
+    if (microtcp_connect (&sock, (struct sockaddr *) &sin, sizeof(sin)) == -1) {
+        client->failed = 1;
+        close (sock.sd);
+        return NULL;
+    }
+
+    while (sent < client->len) {
+        chunk = client->len - sent < SHARD_CHUNK ? client->len - sent : SHARD_CHUNK;
+        if (microtcp_send (&sock, client->data + sent, chunk, 0) != (ssize_t) chunk) {
+            client->failed = 1;
+            break;
+        }
+        sent += chunk;
+    }
+
+    microtcp_shutdown (&sock, SHUT_RDWR);
+    close (sock.sd);
+    return NULL;
+}
+
+/*
+ * Sends the file over clients microTCP connections at once, one thread
+ * each, for server_microtcp_shards() on the other side.
+ */
+int
+client_microtcp_multi (const char *serverip, uint16_t server_port, const char *file,
+                       const char *cc, size_t clients)
+{
+    client_t *args;
+    pthread_t *threads;
+    uint8_t *data;
+    FILE *fp;
+    long len;
+    size_t failed = 0;
+    size_t i;
+    struct timespec start_time;
+    struct timespec end_time;
+
+    fp = fopen (file, "r");
+    if (!fp) {
+        perror ("Open file for reading");
+        return -EXIT_FAILURE;
+    }
+    fseek (fp, 0, SEEK_END);
+    len = ftell (fp);
+    rewind (fp);
+
+    data = malloc (len > 0 ? len : 1);
+    args = calloc (clients, sizeof(*args));
+    threads = malloc (clients * sizeof(*threads));
+    if (!data || !args || !threads) {
+        perror ("Allocate the clients");
+        fclose (fp);
+        return -EXIT_FAILURE;
+    }
+    if (len > 0 && fread (data, 1, len, fp) != (size_t) len) {
+        perror ("Failed read from file");
+        fclose (fp);
+        return -EXIT_FAILURE;
+    }
+    fclose (fp);
+
+    printf ("Starting sending data over %zu connections...\n", clients);
+    clock_gettime (CLOCK_MONOTONIC_RAW, &start_time);
+    for (i = 0; i < clients; i++) {
+        args[i].serverip = serverip;
+        args[i].server_port = server_port;
+        args[i].cc = cc;
+        args[i].data = data;
+        args[i].len = len;
+        if (pthread_create (&threads[i], NULL, client_send, &args[i]) != 0) {
+            perror ("pthread_create");
+            exit (EXIT_FAILURE);
+        }
+    }
+    for (i = 0; i < clients; i++) {
+        pthread_join (threads[i], NULL);
+        failed += args[i].failed;
+    }
+    clock_gettime (CLOCK_MONOTONIC_RAW, &end_time);
+
+    printf ("Data sent, %zu of %zu connections failed. Terminating...\n", failed, clients);
+    print_statistics ((clients - failed) * len, start_time, end_time);
+
+    free (data);
+    free (args);
+    free (threads);
+    return failed > 0 ? -EXIT_FAILURE : 0;
+}
+
 int
 main (int argc, char **argv)
 {
@@ -433,11 +1083,19 @@ main (int argc, char **argv)
     char *filestr = NULL;
     char absolutePath[PATH_MAX];
     char *ipstr = NULL;
+    char *ccstr = NULL;
     uint8_t is_server = 0;
     uint8_t use_microtcp = 0;
+    uint8_t benchmark = 0;
+    double link_mbit = 100;
+    double rtt_ms = 50;
+    long nshards = 0;
+    long clients = 0;
+    uint8_t steer = 0;
+    uint8_t engine = 0;
 
     /* A very easy way to parse command line arguments */
-    while ((opt = getopt (argc, argv, "hsmf:p:a:")) != -1) {
+    while ((opt = getopt (argc, argv, "hsmblief:p:a:c:w:r:n:k:")) != -1) {
         switch (opt)
         {
             /* If -s is set, program runs on server mode */
@@ -473,6 +1131,49 @@ main (int argc, char **argv)
             case 'a':
                 ipstr = strdup (optarg);
                 break;
+            case 'b':
+                benchmark = 1;
+                break;
+            case 'l':
+                benchmark = 2;
+                break;
+            case 'c':
+                ccstr = strdup (optarg);
+                break;
+            case 'w':
+                link_mbit = atof (optarg);
+                if (link_mbit <= 0) {
+                    fprintf(stderr, "Invalid link rate: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'r':
+                rtt_ms = atof (optarg);
+                if (rtt_ms <= 0) {
+                    fprintf(stderr, "Invalid RTT: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'n':
+                nshards = atol (optarg);
+                if (nshards <= 0) {
+                    fprintf(stderr, "Invalid number of threads: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'e':
+                engine = 1;
+                break;
+            case 'i':
+                steer = 1;
+                break;
+            case 'k':
+                clients = atol (optarg);
+                if (clients <= 0) {
+                    fprintf(stderr, "Invalid number of clients: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
 
             default:
                 printf (
@@ -484,6 +1185,21 @@ main (int argc, char **argv)
                         "                       If not, is the source file at the client side that will be sent to the server.\n"
                         "   -p <int>            The listening port of the server\n"
                         "   -a <string>         The IP address of the server. This option is ignored if the tool runs in server mode.\n"
+                        "   -c <string>         The microTCP congestion control of the client (reno, cubic, bbr)\n"
+                        "   -e                  Run a protocol engine thread for the microTCP socket, it keeps the\n"
+                        "                       connection moving between the calls of the program\n"
+                        "   -b                  Benchmark: steady state goodput of the -c congestion control (default cubic)\n"
+                        "                       against Reno on a simulated path, no network is used\n"
+                        "   -w <float>          Benchmark bottleneck rate in Mbit/s (default 100)\n"
+                        "   -r <float>          Benchmark base RTT in ms (default 50)\n"
+                        "   -l                  Benchmark: lookups/s of the connection table of a listening socket\n"
+                        "                       with 1k, 10k and 100k connections, no network is used\n"
+                        "   -k <int>            microTCP with many clients: the client opens this many connections at once,\n"
+                        "                       each sending the file, and the server serves this many and discards the data\n"
+                        "   -n <int>            Threads of the microTCP server with -k, each with its own SO_REUSEPORT\n"
+                        "                       socket on the port (default the number of cores)\n"
+                        "   -i                  With -n, steer the datagrams to the threads by their connection id\n"
+                        "                       with a BPF program instead of by the address of the client\n"
                         "   -h                  prints this help\n");
                 exit (EXIT_FAILURE);
         }
@@ -496,18 +1212,33 @@ main (int argc, char **argv)
     /*
      * Depending the use arguments execute the appropriate functions
      */
-    if (is_server) {
+    if (benchmark == 2) {
+        exit_code = benchmark_demux ();
+    }
+    else if (benchmark) {
+        exit_code = benchmark_microtcp (ccstr ? ccstr : "cubic", link_mbit, rtt_ms);
+    }
+    else if (is_server) {
 
-        if (use_microtcp) {
-            exit_code = server_microtcp (port, filestr);
+        if (use_microtcp && clients > 0) {
+            if (nshards == 0) {
+                nshards = sysconf (_SC_NPROCESSORS_ONLN);
+            }
+            exit_code = server_microtcp_shards (port, nshards > 0 ? nshards : 1, clients, steer);
+        }
+        else if (use_microtcp) {
+            exit_code = server_microtcp (port, filestr, engine);
         }
         else {
             exit_code = server_tcp (port, filestr);
         }
     }
     else {
-        if (use_microtcp) {
-            exit_code = client_microtcp (ipstr, port, filestr);
+        if (use_microtcp && clients > 0) {
+            exit_code = client_microtcp_multi (ipstr, port, filestr, ccstr, clients);
+        }
+        else if (use_microtcp) {
+            exit_code = client_microtcp (ipstr, port, filestr, ccstr, engine);
         }
         else {
             exit_code = client_tcp (ipstr, port, filestr);
@@ -516,5 +1247,6 @@ main (int argc, char **argv)
 
     free (filestr);
     free (ipstr);
+    free (ccstr);
     return exit_code;
 }
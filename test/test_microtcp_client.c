@@ -27,6 +27,7 @@
 
 
 #define SERVER_LISTENING_PORT 12322
+#define MESSAGE_LEN (MICROTCP_MSS_PAYLOAD * 3 + MICROTCP_MSS_PAYLOAD / 2)
 
 int
 main(int argc, char **argv)
@@ -62,10 +63,13 @@ main(int argc, char **argv)
 
     resbuff = malloc(MICROTCP_RECVBUF_LEN);
     ssize_t res;
+    size_t total = 0;
+    //the data is a byte stream now, read until the whole message is here
     do{
-        res = microtcp_recv(&sock, resbuff, MICROTCP_MSS, 0);
-        printf("res = %zu\n", res);
-    } while (sock.state != CLOSING_BY_PEER && res != 0);
+        res = microtcp_recv(&sock, resbuff, MICROTCP_MSS_PAYLOAD, 0);
+        printf("res = %zd\n", res);
+        if(res > 0) total += res;
+    } while (sock.state != CLOSING_BY_PEER && res > 0 && total < MESSAGE_LEN);
 
 
     if(microtcp_shutdown(&sock, 1) == -1){
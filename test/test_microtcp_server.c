@@ -70,22 +70,22 @@ main(int argc, char **argv)
 #endif
 
     //make message to send
-    char *messageToSent = malloc(MICROTCP_MSS * 3 + MICROTCP_MSS/2);
+    char *messageToSent = malloc(MICROTCP_MSS_PAYLOAD * 3 + MICROTCP_MSS_PAYLOAD/2);
     //char messageToSent[] = "In the heart of the bustling city, where skyscrapers touched the clouds and the symphony of car horns played in the background, there existed a hidden oasis. Tucked away between towering buildings and bustling streets, a quaint park emerged like a green jewel amidst the urban chaos. The park, with its winding pathways and vibrant flora, offered a serene retreat for those seeking solace from the frenetic pace of city life. Trees stood tall, their leaves whispering secrets to the wind, while the gentle murmur of a nearby fountain provided a soothing soundtrack. As the sun dipped below the horizon, casting a warm glow on the city skyline, the park transformed into a magical realm, where time seemed to slow down. The air was filled with the scent of blooming flowers, and the soft rustle of leaves created a lullaby that invited visitors to lose themselves in the enchantment of the moment. This hidden gem, though nestled in the midst of urban chaos, served as a reminder that even in the busiest of cities, pockets of tranquility could be found, offering a refuge for those in search of a peaceful escape.In the heart of the bustling city, where skyscrapers touched the clouds and the symphony of car horns played in the background, there existed a hidden oasis. Tucked away between towering buildings and bustling streets, a quaint park emerged like a green jewel amidst the urban chaos. The park, with its winding pathways and vibrant flora, offered a serene retreat for those seeking solace from the frenetic pace of city life. Trees stood tall, their leaves whispering secrets to the wind, while the gentle murmur of a nearby fountain provided a soothing soundtrack. As the sun dipped below the horizon, casting a warm glow on the city skyline, the park transformed into a magical realm, where time seemed to slow down. The air was filled with the scent of blooming flowers, and the soft rustle of leaves created a lullaby that invited visitors to lose themselves in the enchantment of the moment. This hidden gem, though nestled in the midst of urban chaos, served as a reminder that even in the busiest of cities, pockets of tranquility could be found, offering a refuge for those in search of a peaceful escape.In the heart of the bustling city, where skyscrapers touched the clouds and the symphony of car horns played in the background, there existed a hidden oasis. Tucked away between towering buildings and bustling streets, a quaint park emerged like a green jewel amidst the urban chaos. The park, with its winding pathways and vibrant flora, offered a serene retreat for those seeking solace from the frenetic pace of city life. Trees stood tall, their leaves whispering secrets to the wind, while the gentle murmur of a nearby fountain provided a soothing soundtrack. As the sun dipped below the horizon, casting a warm glow on the city skyline, the park transformed into a magical realm, where time seemed to slow down. The air was filled with the scent of blooming flowers, and the soft rustle of leaves created a lullaby that invited visitors to lose themselves in the enchantment of the moment. This hidden gem, though nestled in the midst of urban chaos, served as a reminder that even in the busiest of cities, pockets of tranquility could be found, offering a refuge for those in search of a peaceful escape.In the heart of the bustling city, where skyscrapers touched the clouds and the symphony of car horns played in the background, there existed a hidden oasis. Tucked away between towering buildings and bustling streets, a quaint park emerged like a green jewel amidst the urban chaos. The park, with its winding pathways and vibrant flora, offered a serene retreat for those seeking solace from the frenetic pace of city life. Trees stood tall, their leaves whispering secrets to the wind, while the gentle murmur of a nearby fountain provided a soothing soundtrack. As the sun dipped below the horizon, casting a warm glow on the city skyline, the park transformed into a magical realm, where time seemed to slow down. The air was filled with the scent of blooming flowers, and the soft rustle of leaves created a lullaby that invited visitors to lose themselves in the enchantment of the moment. This hidden gem, though nestled in the midst of urban chaos, served as a reminder that even in the busiest of cities, pockets of tranquility could be found, offering a refuge for those in search of a peaceful escape.In the heart of the bustling city, where skyscrapers touched the clouds and the symphony of car horns played in the background, there existed a hidden oasis. Tucked away between towering buildings and bustling streets, a quaint park emerged like a green jewel amidst the urban chaos. The park, with its winding pathways and vibrant flora, offered a serene retreat for those seeking solace from the frenetic pace of city life. Trees stood tall, their leaves whispering secrets to the wind, while the gentle murmur of a nearby fountain provided a soothing soundtrack. As the sun dipped below the horizon, casting a warm glow on the city skyline, the park transformed into a magical realm, where time seemed to slow down. The air was filled with the scent of blooming flowers, and the soft rustle of leaves created a lullaby that invited visitors to lose themselves in the enchantment of the moment. This hidden gem, though nestled in the midst of urban chaos, served as a reminder that even in the busiest of cities, pockets of tranquility could be found, offering a refuge for those in search of a peaceful escape.In the heart of the bustling city, where skyscrapers touched the clouds and the symphony of car horns played in the background, there existed a hidden oasis. Tucked away between towering buildings and bustling streets, a quaint park emerged like a green jewel amidst the urban chaos. The park, with its winding pathways and vibrant flora, offered a serene retreat for those seeking solace from the frenetic pace of city life. Trees stood tall, their leaves whispering secrets to the wind, while the gentle murmur of a nearby fountain provided a soothing soundtrack. As the sun dipped below the horizon, casting a warm glow on the city skyline, the park transformed into a magical realm, where time seemed to slow down. The air in the d";
-    for (int i = 0; i <= (MICROTCP_MSS * 3 + MICROTCP_MSS / 2) - 1; i++) {
-       /* if(i % MICROTCP_MSS == 0) messageToSent[i] = '!';
+    for (size_t i = 0; i <= (MICROTCP_MSS_PAYLOAD * 3 + MICROTCP_MSS_PAYLOAD / 2) - 1; i++) {
+       /* if(i % MICROTCP_MSS_PAYLOAD == 0) messageToSent[i] = '!';
         else*/ messageToSent[i] = 'A' + (i % 26);
         printf("%c", messageToSent[i]);
     }
     printf("\n");
 
-//    for (int i = 0; i <= (MICROTCP_MSS * 4 + MICROTCP_MSS / 2) - 1; i++) {
+//    for (int i = 0; i <= (MICROTCP_MSS_PAYLOAD * 4 + MICROTCP_MSS_PAYLOAD / 2) - 1; i++) {
 //        printf("%c", messageToSent[i]);
 //    }
 
 
 
-    if(microtcp_send(&sock, messageToSent, MICROTCP_MSS * 3 + MICROTCP_MSS/2, 0) == -1){
+    if(microtcp_send(&sock, messageToSent, MICROTCP_MSS_PAYLOAD * 3 + MICROTCP_MSS_PAYLOAD/2, 0) == -1){
         perror("error with send\n");
         close(sock.sd);
         return 0;
@@ -93,7 +93,8 @@ main(int argc, char **argv)
 
 
 
-    if(microtcp_recv(&sock, &messageToSent, sizeof(messageToSent), 0 ) == -1 && sock.state == CLOSING_BY_PEER){
+    //blocks until the client closes its side
+    if(microtcp_recv(&sock, &messageToSent, sizeof(messageToSent), 0 ) == 0 && sock.state == CLOSING_BY_PEER){
         if(microtcp_shutdown(&sock, 0) == -1){
             perror("error in shutdown");
         }